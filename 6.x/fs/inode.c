@@ -0,0 +1,1509 @@
+/*
+ * $Id$
+ *
+ * inode.c - Cisco flash file system for Linux 6.x
+ *
+ * Copyright (C) 2002 Simon Evans (spse@secret.org.uk)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * Please see the file COPYING for more details
+ *
+ */
+
+#define pr_fmt(fmt) "ciscoffs: " fmt
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/fs_context.h>
+#include <linux/fs_parser.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/statfs.h>
+#include <linux/stringhash.h>
+#include <linux/vmalloc.h>
+#include <linux/uio.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/backing-dev.h>
+#include <linux/crc32.h>
+#include <linux/timekeeping.h>
+#include <linux/unaligned.h>
+#include <linux/mtd/mtd.h>
+#include <linux/mtd/super.h>
+
+#include "fileheader.h"
+
+
+#define CISCOFFS_ROOT_INO	1
+
+/* Inode numbers come from the header offset, which is 4 byte aligned */
+#define POS_INO(pos)		(((unsigned long)(pos) >> 2) + 2)
+
+/* Headers are on 4 byte boundaries */
+#define NEXT_HEADER(x)		(((x) + 3) & ~3)
+
+/* Largest single read made for readahead, in pages */
+#define RA_BATCH		64
+
+/* Free space is checked this many bytes at a time before it is written */
+#define BLANK_CHUNK		(64 << 10)
+
+/* The MTD backing device turns readahead off. Each mount gets its own
+ * backing device with this window, open files take it from there.
+ */
+static unsigned int readahead_kb = 256;
+module_param(readahead_kb, uint, 0644);
+MODULE_PARM_DESC(readahead_kb, "Readahead window for new mounts in KiB (default 256)");
+
+/* The Class A crc is taken to be the standard CRC-32 but that has not been
+ * checked against a card written by a router, so Class A cards are only
+ * mounted read write when asked for.
+ */
+static bool class_a_write;
+module_param(class_a_write, bool, 0644);
+MODULE_PARM_DESC(class_a_write, "Allow writing Class A cards, their CRC is unverified (default off)");
+
+/* The card is scanned once at mount. Every header found goes in entries,
+ * in on-flash order, and the live files also go in a table hashed on
+ * their names which serves lookup. readdir walks entries. New files are
+ * added to the end of entries when they are created, and are pending
+ * until they are written to the flash when the writer closes them.
+ *
+ * entries and table only change with the root directory locked, lookup
+ * and readdir hold it shared. The lock in the ciscoffs_sb covers the
+ * tail, the space counts and the state of each entry. A pending buffer
+ * is covered by the lock of its inode, which is taken first.
+ *
+ * A file being written claims its space by moving the tail, and its
+ * header goes on once every header before it is there, so the chain on
+ * the flash never has a gap in it.
+ */
+struct ciscoffs_entry {
+	u32		magic;
+	u32		pos;		/* header offset */
+	u32		body;		/* offset of the file body */
+	u32		len;
+	u32		date;
+	u16		flags;		/* Class B flags */
+	int		deleted;
+	int		live;		/* shown, not deleted or written again later */
+	unsigned long	ino;
+	int		namelen;
+	char		name[64];
+
+	int		pending;	/* not on the flash yet */
+	u8		*buf;		/* the data of a pending file */
+	size_t		bufsize;
+	struct file	*writer;	/* the open file writing it */
+};
+
+struct ciscoffs_sb {
+	struct ciscoffs_entry **entries;
+	int		count;
+	int		alloced;
+	int		*table;		/* entry index + 1, 0 for empty */
+	unsigned int	mask;
+	struct mutex	lock;
+	u32		magic;		/* class of new files */
+	u32		tail;		/* offset of the free space */
+	u32		chain_end;	/* end of the headers written, up to tail */
+	wait_queue_head_t chain_wait;	/* for chain_end to move */
+	unsigned long	next_ino;	/* for new files */
+	int		broken;		/* a write failed, the tail may not be blank */
+	int		namemax;
+	int		hdrsize;	/* of the headers for this class */
+	u64		live;		/* bytes in live files */
+	u64		deleted;	/* bytes in deleted and replaced files */
+	int		xip;		/* the xip mount option */
+	void		*virt;		/* the whole flash from mtd_point, or NULL */
+	resource_size_t	phys;		/* its physical address if contiguous, or 0 */
+};
+
+static inline struct ciscoffs_sb *CISCOFFS_SB(struct super_block *sb)
+{
+	return sb->s_fs_info;
+}
+
+static const struct super_operations ciscoffs_ops;
+static const struct inode_operations ciscoffs_dir_inode_ops;
+static const struct inode_operations ciscoffs_file_inode_ops;
+static const struct file_operations ciscoffs_dir_ops;
+static const struct file_operations ciscoffs_file_ops;
+static const struct address_space_operations ciscoffs_aops;
+
+
+/* Returns 0 or -EIO, corrected bit flips are not errors */
+static int flash_read(struct mtd_info *mtd, loff_t pos, size_t len, void *buf)
+{
+	size_t retlen;
+	int ret;
+
+	ret = mtd_read(mtd, pos, len, &retlen, buf);
+	if(ret && !mtd_is_bitflip(ret))
+		return -EIO;
+	if(retlen != len)
+		return -EIO;
+	return 0;
+}
+
+
+/* Returns 0 or -EIO */
+static int flash_write(struct mtd_info *mtd, loff_t pos, size_t len, const void *buf)
+{
+	size_t retlen;
+	int ret;
+
+	ret = mtd_write(mtd, pos, len, &retlen, buf);
+	if(ret || retlen != len)
+		return -EIO;
+	return 0;
+}
+
+
+/* Read part of a file body, from the flash mapping when there is one.
+ * Pending files are read from their buffer by read_iter instead.
+ */
+static int read_body(struct inode *inode, loff_t pos, size_t len, void *buf)
+{
+	struct ciscoffs_sb *sbi = CISCOFFS_SB(inode->i_sb);
+	struct ciscoffs_entry *e = inode->i_private;
+
+	if(READ_ONCE(e->pending))
+		return -EBUSY;
+	if(sbi->virt) {
+		memcpy(buf, sbi->virt + e->body + pos, len);
+		return 0;
+	}
+	return flash_read(inode->i_sb->s_mtd, e->body + pos, len, buf);
+}
+
+
+/* Decode the header at buf, avail bytes of which are valid. Returns -1
+ * if there is no header there.
+ */
+static int decode_header(const u8 *buf, size_t avail, u32 pos, struct ciscoffs_entry *e)
+{
+	const char *name;
+	int namemax;
+
+	if(avail < sizeof(u32))
+		return -1;
+	e->magic = get_unaligned_be32(buf);
+	e->pos = pos;
+
+	if(e->magic == CISCO_CLASSB) {
+		if(avail < sizeof(struct cb_hdr))
+			return -1;
+		e->len = get_unaligned_be32(buf + 4);
+		e->date = get_unaligned_be32(buf + 12);
+		e->flags = get_unaligned_be16(buf + 10);
+		e->deleted = !(e->flags & FLAG_DELETED);
+		e->body = pos + sizeof(struct cb_hdr);
+		name = (const char *)buf + 16;
+		namemax = 48;
+	} else if(e->magic == CISCO_CLASSA) {
+		if(avail < sizeof(struct ca_hdr))
+			return -1;
+		e->len = get_unaligned_be32(buf + 72);
+		e->date = get_unaligned_be32(buf + 88);
+		e->deleted = get_unaligned_be32(buf + 100) == CA_DELETED;
+		e->body = pos + sizeof(struct ca_hdr);
+		name = (const char *)buf + 8;
+		namemax = 64;
+	} else {
+		return -1;
+	}
+
+	e->namelen = strnlen(name, namemax - 1);
+	memcpy(e->name, name, e->namelen);
+	e->name[e->namelen] = '\0';
+	e->live = 0;
+	e->ino = POS_INO(pos);
+	return 0;
+}
+
+
+static unsigned int entry_slot(struct ciscoffs_sb *sbi, const char *name, int len)
+{
+	return full_name_hash(NULL, name, len) & sbi->mask;
+}
+
+
+static struct ciscoffs_entry *find_entry(struct ciscoffs_sb *sbi, const char *name, int len)
+{
+	unsigned int slot;
+
+	for(slot = entry_slot(sbi, name, len); sbi->table[slot]; slot = (slot + 1) & sbi->mask) {
+		struct ciscoffs_entry *e = sbi->entries[sbi->table[slot] - 1];
+
+		/* Deleted files stay in the table until it is rebuilt */
+		if(e->live && e->namelen == len && !memcmp(e->name, name, len))
+			return e;
+	}
+	return NULL;
+}
+
+
+static void table_insert(struct ciscoffs_sb *sbi, int index)
+{
+	struct ciscoffs_entry *e = sbi->entries[index];
+	unsigned int slot;
+
+	for(slot = entry_slot(sbi, e->name, e->namelen); sbi->table[slot];
+	    slot = (slot + 1) & sbi->mask)
+		;
+	sbi->table[slot] = index + 1;
+}
+
+
+/* Rebuild the table from the live files, at least twice the size of
+ * entries so there are always empty slots.
+ */
+static int rehash(struct ciscoffs_sb *sbi)
+{
+	unsigned int size = 16;
+	int *table, cnt;
+
+	while(size < 2 * (unsigned int)sbi->count)
+		size <<= 1;
+	table = kvcalloc(size, sizeof(int), GFP_KERNEL);
+	if(!table)
+		return -ENOMEM;
+	kvfree(sbi->table);
+	sbi->table = table;
+	sbi->mask = size - 1;
+
+	for(cnt = 0; cnt < sbi->count; cnt++)
+		if(sbi->entries[cnt]->live)
+			table_insert(sbi, cnt);
+	return 0;
+}
+
+
+static int add_entry(struct ciscoffs_sb *sbi, struct ciscoffs_entry *e)
+{
+	struct ciscoffs_entry **grown;
+
+	if(sbi->count == sbi->alloced) {
+		grown = kvmalloc_array(sbi->alloced + 64, sizeof(*grown), GFP_KERNEL);
+		if(!grown)
+			return -ENOMEM;
+		if(sbi->count)
+			memcpy(grown, sbi->entries, sbi->count * sizeof(*grown));
+		kvfree(sbi->entries);
+		sbi->entries = grown;
+		sbi->alloced += 64;
+	}
+	sbi->entries[sbi->count++] = e;
+	return 0;
+}
+
+
+/* Walk the header chain once, with one read per header */
+static int scan_chain(struct super_block *sb)
+{
+	struct ciscoffs_sb *sbi = CISCOFFS_SB(sb);
+	struct mtd_info *mtd = sb->s_mtd;
+	struct ciscoffs_entry *e = NULL;
+	u8 buf[sizeof(struct ca_hdr)];
+	u64 pos = 0, end;
+	size_t len;
+	int ret;
+
+	while(pos < mtd->size) {
+		len = min_t(u64, sizeof(buf), mtd->size - pos);
+		ret = flash_read(mtd, pos, len, buf);
+		if(ret)
+			return ret;
+		if(!e) {
+			e = kzalloc(sizeof(*e), GFP_KERNEL);
+			if(!e)
+				return -ENOMEM;
+		}
+		if(decode_header(buf, len, pos, e))
+			break;
+		end = (u64)e->body + e->len;
+		if(end > mtd->size) {
+			pr_warn("file %s at 0x%08llX runs past the end of the flash\n",
+				e->name, pos);
+			break;
+		}
+
+		if(add_entry(sbi, e)) {
+			kfree(e);
+			return -ENOMEM;
+		}
+		e = NULL;
+		pos = NEXT_HEADER(end);
+	}
+	kfree(e);
+	sbi->tail = min_t(u64, pos, mtd->size);
+	return 0;
+}
+
+
+/* Space taken by a header, its file and the padding after it */
+static u32 entry_space(struct ciscoffs_entry *e)
+{
+	return NEXT_HEADER(e->body + e->len) - e->pos;
+}
+
+
+/* Build the name table from the scan. A name written more than once is
+ * the last live copy on the flash.
+ */
+static int build_table(struct ciscoffs_sb *sbi)
+{
+	unsigned int size = 16, slot;
+	struct ciscoffs_entry *e, *old;
+	int cnt;
+
+	while(size < 2 * (unsigned int)sbi->count)
+		size <<= 1;
+	sbi->table = kvcalloc(size, sizeof(int), GFP_KERNEL);
+	if(!sbi->table)
+		return -ENOMEM;
+	sbi->mask = size - 1;
+
+	for(cnt = 0; cnt < sbi->count; cnt++) {
+		e = sbi->entries[cnt];
+		if(e->deleted || !e->namelen)
+			continue;
+		e->live = 1;
+		for(slot = entry_slot(sbi, e->name, e->namelen); sbi->table[slot];
+		    slot = (slot + 1) & sbi->mask) {
+			old = sbi->entries[sbi->table[slot] - 1];
+			if(old->namelen == e->namelen && !memcmp(old->name, e->name, e->namelen)) {
+				old->live = 0;
+				break;
+			}
+		}
+		sbi->table[slot] = cnt + 1;
+	}
+
+	/* Kept up to date from here on so statfs never needs a scan */
+	for(cnt = 0; cnt < sbi->count; cnt++) {
+		e = sbi->entries[cnt];
+		if(e->live)
+			sbi->live += entry_space(e);
+		else
+			sbi->deleted += entry_space(e);
+	}
+	return 0;
+}
+
+
+/* Point at the whole flash for the xip option. mtd_point is asked again
+ * for the physical address, as some drivers can only give it for part of
+ * the flash. Returns -1 if the device cant be pointed at.
+ */
+static int point_flash(struct super_block *sb)
+{
+	struct ciscoffs_sb *sbi = CISCOFFS_SB(sb);
+	struct mtd_info *mtd = sb->s_mtd;
+	resource_size_t phys;
+	size_t retlen;
+	void *virt;
+
+	if(mtd_point(mtd, 0, mtd->size, &retlen, &sbi->virt, NULL))
+		return -1;
+	if(retlen != mtd->size) {
+		mtd_unpoint(mtd, 0, retlen);
+		sbi->virt = NULL;
+		return -1;
+	}
+
+	if(!mtd_point(mtd, 0, mtd->size, &retlen, &virt, &phys)) {
+		if(retlen == mtd->size && phys)
+			sbi->phys = phys;
+		else
+			mtd_unpoint(mtd, 0, retlen);
+	}
+	return 0;
+}
+
+
+static void unpoint_flash(struct super_block *sb)
+{
+	struct ciscoffs_sb *sbi = CISCOFFS_SB(sb);
+
+	if(sbi->phys)
+		mtd_unpoint(sb->s_mtd, 0, sb->s_mtd->size);
+	if(sbi->virt)
+		mtd_unpoint(sb->s_mtd, 0, sb->s_mtd->size);
+	sbi->phys = 0;
+	sbi->virt = NULL;
+}
+
+
+static void free_sb_info(struct ciscoffs_sb *sbi)
+{
+	int cnt;
+
+	if(!sbi)
+		return;
+	for(cnt = 0; cnt < sbi->count; cnt++) {
+		struct ciscoffs_entry *e = sbi->entries[cnt];
+
+		if(e->pending && !e->deleted)
+			pr_warn("%s was never written to the flash\n", e->name);
+		kvfree(e->buf);
+		kfree(e);
+	}
+	kvfree(sbi->entries);
+	kvfree(sbi->table);
+	kfree(sbi);
+}
+
+
+static struct inode *ciscoffs_iget(struct super_block *sb, struct ciscoffs_entry *e)
+{
+	struct inode *inode;
+	struct timespec64 ts = { 0, 0 };
+
+	inode = iget_locked(sb, e ? e->ino : CISCOFFS_ROOT_INO);
+	if(!inode)
+		return ERR_PTR(-ENOMEM);
+	if(!(inode->i_state & I_NEW))
+		return inode;
+
+	if(!e) {
+		/* Fake dir */
+		inode->i_mode = S_IFDIR | 0755;
+		set_nlink(inode, 2);
+		inode->i_size = 16;
+		inode->i_op = &ciscoffs_dir_inode_ops;
+		inode->i_fop = &ciscoffs_dir_ops;
+	} else {
+		/* Only files not yet on the flash can be written */
+		inode->i_mode = S_IFREG | (e->pending ? 0644 : 0444);
+		set_nlink(inode, 1);
+		inode->i_size = e->len;
+		inode->i_op = &ciscoffs_file_inode_ops;
+		inode->i_fop = &ciscoffs_file_ops;
+		inode->i_mapping->a_ops = &ciscoffs_aops;
+		inode->i_private = e;
+		ts.tv_sec = e->date;
+	}
+	inode_set_mtime_to_ts(inode, ts);
+	inode_set_atime_to_ts(inode, ts);
+	inode_set_ctime_to_ts(inode, ts);
+	unlock_new_inode(inode);
+	return inode;
+}
+
+
+static struct dentry *ciscoffs_lookup(struct inode *dir, struct dentry *dentry,
+				      unsigned int flags)
+{
+	struct ciscoffs_sb *sbi = CISCOFFS_SB(dir->i_sb);
+	struct ciscoffs_entry *e;
+	struct inode *inode = NULL;
+
+	if(dentry->d_name.len > sbi->namemax)
+		return ERR_PTR(-ENAMETOOLONG);
+
+	e = find_entry(sbi, (const char *)dentry->d_name.name, dentry->d_name.len);
+	if(e)
+		inode = ciscoffs_iget(dir->i_sb, e);
+	return d_splice_alias(inode, dentry);
+}
+
+
+/* Position 2 onwards is the index in entries plus 2 */
+static int ciscoffs_readdir(struct file *file, struct dir_context *ctx)
+{
+	struct ciscoffs_sb *sbi = CISCOFFS_SB(file_inode(file)->i_sb);
+	struct ciscoffs_entry *e;
+
+	if(!dir_emit_dots(file, ctx))
+		return 0;
+
+	for(; ctx->pos - 2 < sbi->count; ctx->pos++) {
+		e = sbi->entries[ctx->pos - 2];
+		if(!e->live)
+			continue;
+		if(!dir_emit(ctx, e->name, e->namelen, e->ino, DT_REG))
+			return 0;
+	}
+	return 0;
+}
+
+
+static int ciscoffs_read_folio(struct file *file, struct folio *folio)
+{
+	struct inode *inode = folio->mapping->host;
+	loff_t offset = folio_pos(folio);
+	size_t len = 0;
+	void *buf;
+	int ret = 0;
+
+	buf = kmap_local_folio(folio, 0);
+	if(offset < inode->i_size) {
+		len = min_t(loff_t, inode->i_size - offset, PAGE_SIZE);
+		ret = read_body(inode, offset, len, buf);
+		if(ret)
+			len = 0;
+	}
+	memset(buf + len, 0, PAGE_SIZE - len);
+	flush_dcache_folio(folio);
+	kunmap_local(buf);
+
+	if(!ret)
+		folio_mark_uptodate(folio);
+	folio_unlock(folio);
+	return ret;
+}
+
+
+/* Fill a run of page cache pages with one read straight into them, mapped
+ * together with vmap. The mapping only has single page folios. Pages left
+ * unfilled are read again by read_folio, which reports any error.
+ */
+static void fill_pages(struct inode *inode, struct page **pages, unsigned int nr)
+{
+	loff_t pos = page_offset(pages[0]);
+	size_t size = (size_t)nr << PAGE_SHIFT;
+	size_t len = 0;
+	unsigned int cnt;
+	void *buf;
+	int ret = -ENOMEM;
+
+	buf = vmap(pages, nr, VM_MAP, PAGE_KERNEL);
+	if(buf) {
+		ret = 0;
+		if(pos < inode->i_size) {
+			len = min_t(loff_t, inode->i_size - pos, size);
+			ret = read_body(inode, pos, len, buf);
+		}
+		if(!ret)
+			memset(buf + len, 0, size - len);
+		flush_kernel_vmap_range(buf, size);
+		vunmap(buf);
+	}
+
+	for(cnt = 0; cnt < nr; cnt++) {
+		struct folio *folio = page_folio(pages[cnt]);
+
+		if(!ret) {
+			flush_dcache_folio(folio);
+			folio_mark_uptodate(folio);
+		}
+		folio_unlock(folio);
+	}
+}
+
+
+/* The pages of a readahead request are contiguous, so they are read in
+ * runs of RA_BATCH rather than a page at a time.
+ */
+static void ciscoffs_readahead(struct readahead_control *rac)
+{
+	struct inode *inode = rac->mapping->host;
+	struct page **pages;
+	struct folio *folio;
+	unsigned int nr = 0;
+
+	/* Folios not taken here are unlocked by the caller */
+	pages = kmalloc_array(RA_BATCH, sizeof(*pages), readahead_gfp_mask(rac->mapping));
+	if(!pages)
+		return;
+
+	while((folio = readahead_folio(rac))) {
+		pages[nr++] = folio_page(folio, 0);
+		if(nr == RA_BATCH) {
+			fill_pages(inode, pages, nr);
+			nr = 0;
+		}
+	}
+	if(nr)
+		fill_pages(inode, pages, nr);
+	kfree(pages);
+}
+
+
+/* A file can only be opened for writing before it is on the flash, by
+ * one writer at a time.
+ */
+static int ciscoffs_open(struct inode *inode, struct file *file)
+{
+	struct ciscoffs_sb *sbi = CISCOFFS_SB(inode->i_sb);
+	struct ciscoffs_entry *e = inode->i_private;
+	int ret = 0;
+
+	if(file->f_mode & FMODE_WRITE) {
+		mutex_lock(&sbi->lock);
+		if(!e->pending || e->deleted)
+			ret = -EPERM;
+		else if(e->writer)
+			ret = -EBUSY;
+		else
+			e->writer = file;
+		mutex_unlock(&sbi->lock);
+		if(ret)
+			return ret;
+	}
+	return generic_file_open(inode, file);
+}
+
+
+/* With xip, reads are copied straight from the flash mapping to the user
+ * and skip the page cache.
+ */
+static ssize_t ciscoffs_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct ciscoffs_sb *sbi = CISCOFFS_SB(inode->i_sb);
+	struct ciscoffs_entry *e = inode->i_private;
+	loff_t pos = iocb->ki_pos;
+	size_t len, copied;
+
+	if(READ_ONCE(e->pending)) {
+		inode_lock_shared(inode);
+		if(e->pending) {
+			len = copied = 0;
+			if(pos < e->len) {
+				len = min_t(loff_t, iov_iter_count(to), e->len - pos);
+				copied = copy_to_iter(e->buf + pos, len, to);
+				iocb->ki_pos += copied;
+			}
+			inode_unlock_shared(inode);
+			return (len && !copied) ? -EFAULT : copied;
+		}
+		inode_unlock_shared(inode);
+	}
+
+	if(!sbi->virt)
+		return generic_file_read_iter(iocb, to);
+
+	if(pos >= inode->i_size || !iov_iter_count(to))
+		return 0;
+	len = min_t(loff_t, iov_iter_count(to), inode->i_size - pos);
+	copied = copy_to_iter(sbi->virt + e->body + pos, len, to);
+	if(!copied)
+		return -EFAULT;
+	iocb->ki_pos += copied;
+	return copied;
+}
+
+
+/* A shared mapping of whole pages of a file whose body is page aligned in
+ * a physically contiguous flash is mapped straight from the flash. Every
+ * other mapping goes through the page cache.
+ */
+static int ciscoffs_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct inode *inode = file_inode(file);
+	struct ciscoffs_sb *sbi = CISCOFFS_SB(inode->i_sb);
+	struct ciscoffs_entry *e = inode->i_private;
+	unsigned long pages = vma_pages(vma);
+	resource_size_t addr;
+
+	/* The data of a pending file is not in the page cache */
+	if(READ_ONCE(e->pending))
+		return -EBUSY;
+
+	addr = sbi->phys + e->body + ((resource_size_t)vma->vm_pgoff << PAGE_SHIFT);
+	if(!sbi->phys || !PAGE_ALIGNED(addr) || is_cow_mapping(vma->vm_flags) ||
+	   (vma->vm_flags & VM_WRITE) || vma->vm_pgoff + pages > inode->i_size >> PAGE_SHIFT)
+		return generic_file_readonly_mmap(file, vma);
+
+	file_accessed(file);
+	return remap_pfn_range(vma, vma->vm_start, addr >> PAGE_SHIFT,
+			       vma->vm_end - vma->vm_start, vma->vm_page_prot);
+}
+
+
+static ssize_t ciscoffs_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe,
+				    size_t len, unsigned int flags)
+{
+	struct ciscoffs_entry *e = file_inode(in)->i_private;
+
+	if(READ_ONCE(e->pending))
+		return copy_splice_read(in, ppos, pipe, len, flags);
+	return filemap_splice_read(in, ppos, pipe, len, flags);
+}
+
+
+/* Checksum of a file body, as file_sum() in the cffs tool. Class A uses
+ * the standard CRC-32, Class B a 16 bit ones complement sum.
+ */
+static u32 body_sum(u32 magic, const u8 *buf, size_t len)
+{
+	u32 chk = 0;
+
+	if(magic == CISCO_CLASSA)
+		return ~crc32_le(~0, buf, len);
+
+	while(len > 1) {
+		chk += (u16)~get_unaligned_be16(buf);
+		chk = (chk & 0xffff) + (chk >> 16);
+		buf += 2;
+		len -= 2;
+	}
+	if(len) {
+		chk += (u16)~(buf[0] << 8);
+		chk = (chk & 0xffff) + (chk >> 16);
+	}
+	return chk;
+}
+
+
+/* Encode the header of a new file into buf, which must hold a struct
+ * ca_hdr. Returns its length.
+ */
+static int encode_header(struct ciscoffs_entry *e, u32 sum, u8 *buf)
+{
+	memset(buf, 0, sizeof(struct ca_hdr));
+
+	if(e->magic == CISCO_CLASSB) {
+		put_unaligned_be32(CISCO_CLASSB, buf);
+		put_unaligned_be32(e->len, buf + 4);
+		put_unaligned_be16(sum, buf + 8);
+		put_unaligned_be16(e->flags, buf + 10);
+		put_unaligned_be32(e->date, buf + 12);
+		memcpy(buf + 16, e->name, e->namelen);
+		return sizeof(struct cb_hdr);
+	}
+
+	put_unaligned_be32(CISCO_CLASSA, buf);
+	put_unaligned_be32(1, buf + 4);
+	memcpy(buf + 8, e->name, e->namelen);
+	put_unaligned_be32(e->len, buf + 72);
+	put_unaligned_be32(e->body, buf + 76);
+	put_unaligned_be32(sum, buf + 80);
+	put_unaligned_be32(1, buf + 84);
+	put_unaligned_be32(e->date, buf + 88);
+	put_unaligned_be32(0, buf + 92);
+	put_unaligned_be32(0xFFFFFFF8, buf + 96);
+	put_unaligned_be32(0xFFFFFFFF, buf + 100);
+	return sizeof(struct ca_hdr);
+}
+
+
+/* Program a file body in pieces that each end on an erase block
+ * boundary, so all but the first and last are whole blocks.
+ */
+static int write_body(struct mtd_info *mtd, u32 pos, const u8 *buf, u32 len)
+{
+	u32 part;
+	int ret;
+
+	while(len) {
+		part = min_t(u32, len, mtd->erasesize - pos % mtd->erasesize);
+		ret = flash_write(mtd, pos, part, buf);
+		if(ret)
+			return ret;
+		pos += part;
+		buf += part;
+		len -= part;
+	}
+	return 0;
+}
+
+
+/* The space a file is written to must still be erased. A scan that
+ * stopped at a damaged header leaves the tail on top of it. buf holds
+ * BLANK_CHUNK bytes.
+ */
+static int check_blank(struct mtd_info *mtd, u32 pos, u32 len, u8 *buf)
+{
+	u32 part;
+	int ret;
+
+	while(len) {
+		part = min_t(u32, len, BLANK_CHUNK);
+		ret = flash_read(mtd, pos, part, buf);
+		if(ret)
+			return ret;
+		if(memchr_inv(buf, 0xff, part)) {
+			pr_err("%s: flash at 0x%08X is not blank\n", mtd->name, pos);
+			return -EIO;
+		}
+		pos += part;
+		len -= part;
+	}
+	return 0;
+}
+
+
+/* Write a pending file at the tail. The body goes first and the header
+ * last, so the file is not found on the flash until all of it is there.
+ * Only claiming the space and adding the header are done under the lock.
+ * A pending file deleted before it was written is dropped. Called with
+ * the inode locked.
+ */
+static int commit_file(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ciscoffs_sb *sbi = CISCOFFS_SB(sb);
+	struct mtd_info *mtd = sb->s_mtd;
+	struct ciscoffs_entry *e = inode->i_private;
+	u8 hdr[sizeof(struct ca_hdr)];
+	struct timespec64 ts = { 0, 0 };
+	u32 pos, next, date;
+	u8 *blank;
+	int ret = 0, len;
+
+	blank = kmalloc(BLANK_CHUNK, GFP_KERNEL);
+	if(!blank)
+		return -ENOMEM;
+
+	mutex_lock(&sbi->lock);
+	if(!e->pending)
+		goto out_unlock;
+	if(e->deleted) {
+		e->pending = 0;
+		mutex_unlock(&sbi->lock);
+		goto drop;
+	}
+	if(sbi->broken) {
+		ret = -EIO;
+		goto out_unlock;
+	}
+	if((u64)sbi->tail + sbi->hdrsize + e->len > mtd->size) {
+		ret = -ENOSPC;
+		goto out_unlock;
+	}
+	pos = sbi->tail;
+	next = min_t(u64, NEXT_HEADER((u64)pos + sbi->hdrsize + e->len), mtd->size);
+	sbi->tail = next;
+	mutex_unlock(&sbi->lock);
+
+	date = ktime_get_real_seconds();
+	ret = check_blank(mtd, pos, next - pos, blank);
+	if(!ret)
+		ret = write_body(mtd, pos + sbi->hdrsize, e->buf, e->len);
+
+	mutex_lock(&sbi->lock);
+	while(!ret && sbi->chain_end != pos && !sbi->broken) {
+		mutex_unlock(&sbi->lock);
+		wait_event(sbi->chain_wait,
+			   READ_ONCE(sbi->chain_end) == pos || READ_ONCE(sbi->broken));
+		mutex_lock(&sbi->lock);
+	}
+	if(!ret && sbi->broken)
+		ret = -EIO;
+	if(!ret) {
+		e->pos = pos;
+		e->body = pos + sbi->hdrsize;
+		e->date = date;
+		len = encode_header(e, body_sum(e->magic, e->buf, e->len), hdr);
+		ret = flash_write(mtd, pos, len, hdr);
+	}
+	if(ret) {
+		/* The space is claimed and part of it may be written, so the
+		 * chain can not go past it
+		 */
+		sbi->broken = 1;
+		wake_up_all(&sbi->chain_wait);
+		pr_err("%s: writing %s at 0x%08X failed, check the card with cffs\n",
+		       mtd->name, e->name, pos);
+		goto out_unlock;
+	}
+	sbi->chain_end = next;
+	sbi->live += entry_space(e);
+	WRITE_ONCE(e->pending, 0);
+	wake_up_all(&sbi->chain_wait);
+	mutex_unlock(&sbi->lock);
+
+	mtd_sync(mtd);
+	ts.tv_sec = date;
+	inode_set_mtime_to_ts(inode, ts);
+	inode_set_ctime_to_ts(inode, ts);
+	inode->i_mode = S_IFREG | 0444;
+	/* Anything read ahead while it was pending did not come from here */
+	truncate_inode_pages(inode->i_mapping, 0);
+ drop:
+	kvfree(e->buf);
+	e->buf = NULL;
+	e->bufsize = 0;
+	kfree(blank);
+	return 0;
+
+ out_unlock:
+	mutex_unlock(&sbi->lock);
+	kfree(blank);
+	return ret;
+}
+
+
+/* The largest file that fits in the free space now */
+static u64 body_room(struct super_block *sb)
+{
+	struct ciscoffs_sb *sbi = CISCOFFS_SB(sb);
+	u64 used = (u64)READ_ONCE(sbi->tail) + sbi->hdrsize;
+
+	return (used < sb->s_mtd->size) ? sb->s_mtd->size - used : 0;
+}
+
+
+/* Make room for size bytes in the buffer of a pending file. Called with
+ * the inode locked.
+ */
+static int grow_buffer(struct inode *inode, loff_t size)
+{
+	struct ciscoffs_entry *e = inode->i_private;
+	u64 avail = body_room(inode->i_sb);
+	size_t want;
+	u8 *buf;
+
+	if(size > avail)
+		return -ENOSPC;
+	if(size <= e->bufsize)
+		return 0;
+
+	want = max_t(size_t, size, 2 * e->bufsize);
+	want = max_t(size_t, want, PAGE_SIZE);
+	want = min_t(u64, want, avail);
+	buf = kvmalloc(want, GFP_KERNEL);
+	if(!buf)
+		return -ENOMEM;
+	if(e->len)
+		memcpy(buf, e->buf, e->len);
+	kvfree(e->buf);
+	e->buf = buf;
+	e->bufsize = want;
+	return 0;
+}
+
+
+/* New files are buffered in memory until the writer closes them */
+static ssize_t ciscoffs_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	struct ciscoffs_entry *e = inode->i_private;
+	size_t copied;
+	loff_t end;
+	u64 room;
+	ssize_t ret;
+
+	inode_lock(inode);
+	if(!e->pending || e->writer != file) {
+		ret = -EPERM;
+		goto out;
+	}
+	ret = generic_write_checks(iocb, from);
+	if(ret <= 0)
+		goto out;
+
+	/* Write what fits, as a full disk does */
+	room = body_room(inode->i_sb);
+	if(iocb->ki_pos >= room) {
+		ret = -ENOSPC;
+		goto out;
+	}
+	iov_iter_truncate(from, room - iocb->ki_pos);
+	end = iocb->ki_pos + iov_iter_count(from);
+	ret = grow_buffer(inode, end);
+	if(ret)
+		goto out;
+	if(iocb->ki_pos > e->len)
+		memset(e->buf + e->len, 0, iocb->ki_pos - e->len);
+	copied = copy_from_iter(e->buf + iocb->ki_pos, end - iocb->ki_pos, from);
+	if(!copied) {
+		ret = -EFAULT;
+		goto out;
+	}
+	iocb->ki_pos += copied;
+	if(iocb->ki_pos > e->len) {
+		e->len = iocb->ki_pos;
+		i_size_write(inode, e->len);
+	}
+	inode_set_mtime_to_ts(inode, inode_set_ctime_current(inode));
+	ret = copied;
+ out:
+	inode_unlock(inode);
+	return ret;
+}
+
+
+/* Called for every close, the last one of the writer commits the file so
+ * close() can report an error
+ */
+static int ciscoffs_flush(struct file *file, fl_owner_t id)
+{
+	struct inode *inode = file_inode(file);
+	struct ciscoffs_sb *sbi = CISCOFFS_SB(inode->i_sb);
+	struct ciscoffs_entry *e = inode->i_private;
+	int writer, ret;
+
+	mutex_lock(&sbi->lock);
+	writer = e->writer == file;
+	mutex_unlock(&sbi->lock);
+	if(!writer || file_count(file) > 1)
+		return 0;
+	inode_lock(inode);
+	ret = commit_file(inode);
+	inode_unlock(inode);
+	return ret;
+}
+
+
+/* A file whose commit failed stays pending, it can be opened to write
+ * it again or deleted.
+ */
+static int ciscoffs_release(struct inode *inode, struct file *file)
+{
+	struct ciscoffs_sb *sbi = CISCOFFS_SB(inode->i_sb);
+	struct ciscoffs_entry *e = inode->i_private;
+	int writer;
+
+	mutex_lock(&sbi->lock);
+	writer = e->writer == file;
+	mutex_unlock(&sbi->lock);
+	if(!writer)
+		return 0;
+	inode_lock(inode);
+	if(e->pending && commit_file(inode))
+		pr_warn("%s is still pending\n", e->name);
+	inode_unlock(inode);
+
+	mutex_lock(&sbi->lock);
+	e->writer = NULL;
+	mutex_unlock(&sbi->lock);
+	return 0;
+}
+
+
+/* Only the size of a pending file can be changed */
+static int ciscoffs_setattr(struct mnt_idmap *idmap, struct dentry *dentry, struct iattr *attr)
+{
+	struct inode *inode = d_inode(dentry);
+	struct ciscoffs_entry *e = inode->i_private;
+	int ret;
+
+	ret = setattr_prepare(idmap, dentry, attr);
+	if(ret)
+		return ret;
+	if(!(attr->ia_valid & ATTR_SIZE) || !e->pending)
+		return -EPERM;
+
+	ret = grow_buffer(inode, attr->ia_size);
+	if(ret)
+		return ret;
+	if(attr->ia_size > e->len)
+		memset(e->buf + e->len, 0, attr->ia_size - e->len);
+	e->len = attr->ia_size;
+	i_size_write(inode, e->len);
+	setattr_copy(idmap, inode, attr);
+	return 0;
+}
+
+
+static int ciscoffs_create(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry,
+			   umode_t mode, bool excl)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ciscoffs_sb *sbi = CISCOFFS_SB(sb);
+	struct ciscoffs_entry *e;
+	struct inode *inode;
+	int ret;
+
+	if(dentry->d_name.len > sbi->namemax)
+		return -ENAMETOOLONG;
+	if((u64)READ_ONCE(sbi->tail) + sbi->hdrsize > sb->s_mtd->size)
+		return -ENOSPC;
+
+	e = kzalloc(sizeof(*e), GFP_KERNEL);
+	if(!e)
+		return -ENOMEM;
+	e->magic = sbi->magic;
+	e->flags = 0xFFFF & ~FLAG_HASDATE;
+	e->namelen = dentry->d_name.len;
+	memcpy(e->name, dentry->d_name.name, e->namelen);
+	e->date = ktime_get_real_seconds();
+	e->live = 1;
+	e->pending = 1;
+
+	mutex_lock(&sbi->lock);
+	e->ino = sbi->next_ino++;
+	mutex_unlock(&sbi->lock);
+
+	ret = add_entry(sbi, e);
+	if(ret) {
+		kfree(e);
+		return ret;
+	}
+	if(2 * (unsigned int)sbi->count > sbi->mask + 1)
+		ret = rehash(sbi);
+	else
+		table_insert(sbi, sbi->count - 1);
+	if(ret) {
+		sbi->count--;
+		kfree(e);
+		return ret;
+	}
+
+	inode = ciscoffs_iget(sb, e);
+	if(IS_ERR(inode)) {
+		e->live = 0;
+		e->deleted = 1;
+		e->pending = 0;
+		return PTR_ERR(inode);
+	}
+	inode_set_mtime_to_ts(inode, inode_set_ctime_current(inode));
+	d_instantiate(dentry, inode);
+	return 0;
+}
+
+
+/* Class B files are deleted by clearing FLAG_DELETED in their header */
+static int mark_deleted(struct mtd_info *mtd, struct ciscoffs_entry *e)
+{
+	__be16 flags = cpu_to_be16(e->flags & ~FLAG_DELETED);
+	__be16 check;
+	int ret;
+
+	ret = flash_write(mtd, e->pos + 10, sizeof(flags), &flags);
+	if(!ret)
+		ret = flash_read(mtd, e->pos + 10, sizeof(check), &check);
+	if(!ret && (be16_to_cpu(check) & FLAG_DELETED))
+		ret = -EIO;
+	if(!ret)
+		e->flags &= ~FLAG_DELETED;
+	return ret;
+}
+
+
+static int ciscoffs_unlink(struct inode *dir, struct dentry *dentry)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ciscoffs_sb *sbi = CISCOFFS_SB(sb);
+	struct inode *inode = d_inode(dentry);
+	struct ciscoffs_entry *e = inode->i_private;
+	int ret = 0;
+
+	mutex_lock(&sbi->lock);
+	if(e->pending) {
+		/* Never written, a writer still open drops it on close */
+		if(!e->writer) {
+			kvfree(e->buf);
+			e->buf = NULL;
+			e->bufsize = 0;
+			e->len = 0;
+			e->pending = 0;
+			i_size_write(inode, 0);
+		}
+	} else if(e->magic != CISCO_CLASSB) {
+		/* As the cffs tool, Class A files are never deleted */
+		ret = -EOPNOTSUPP;
+	} else if(sbi->broken) {
+		ret = -EIO;
+	} else {
+		ret = mark_deleted(sb->s_mtd, e);
+		if(!ret) {
+			sbi->live -= entry_space(e);
+			sbi->deleted += entry_space(e);
+		}
+	}
+	if(!ret) {
+		e->deleted = 1;
+		e->live = 0;
+	}
+	mutex_unlock(&sbi->lock);
+	if(ret)
+		return ret;
+
+	inode_set_mtime_to_ts(dir, inode_set_ctime_current(dir));
+	inode_set_ctime_current(inode);
+	clear_nlink(inode);
+	return 0;
+}
+
+
+static int ciscoffs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct super_block *sb = dentry->d_sb;
+	struct ciscoffs_sb *sbi = CISCOFFS_SB(sb);
+	u64 free = sb->s_mtd->size - sbi->tail;
+
+	buf->f_type = sb->s_magic;
+	buf->f_bsize = sb->s_blocksize;
+	buf->f_blocks = sb->s_mtd->size >> sb->s_blocksize_bits;
+	buf->f_bfree = buf->f_bavail = free >> sb->s_blocksize_bits;
+	/* Each new file needs at least a header */
+	buf->f_ffree = div_u64(free, sbi->hdrsize);
+	buf->f_files = sbi->count + buf->f_ffree;
+	buf->f_namelen = sbi->namemax;
+	return 0;
+}
+
+
+/* Appended to the line for the mount in /proc/self/mountstats */
+static int ciscoffs_show_stats(struct seq_file *m, struct dentry *root)
+{
+	struct super_block *sb = root->d_sb;
+	struct ciscoffs_sb *sbi = CISCOFFS_SB(sb);
+
+	seq_printf(m, "live %llu deleted %llu free %llu headers %d", sbi->live,
+		   sbi->deleted, sb->s_mtd->size - sbi->tail, sbi->count);
+	return 0;
+}
+
+
+/* Files are written with byte writes and deleted by clearing a bit in
+ * place, which needs NOR like flash. Files read with xip would change
+ * under the mapping. Class A cards also need class_a_write.
+ */
+static int ciscoffs_writeable(struct super_block *sb)
+{
+	struct mtd_info *mtd = sb->s_mtd;
+
+	if(CISCOFFS_SB(sb)->magic == CISCO_CLASSA && !class_a_write)
+		return 0;
+	return (mtd->flags & MTD_WRITEABLE) && mtd->writesize == 1 && !CISCOFFS_SB(sb)->virt;
+}
+
+
+/* do_dentry_open() sets the readahead window of each file from the
+ * backing device after ->open, so it has to be set here
+ */
+static int setup_bdi(struct super_block *sb)
+{
+	struct backing_dev_info *old = sb->s_bdi;
+	int ret;
+
+	ret = super_setup_bdi(sb);
+	if(ret)
+		return ret;
+	if(old && old != &noop_backing_dev_info)
+		bdi_put(old);
+	sb->s_bdi->ra_pages = readahead_kb >> (PAGE_SHIFT - 10);
+	return 0;
+}
+
+
+static int ciscoffs_fill_super(struct super_block *sb, struct fs_context *fc)
+{
+	struct ciscoffs_sb *sbi = CISCOFFS_SB(sb);
+	struct mtd_info *mtd = sb->s_mtd;
+	struct inode *root;
+	__be32 raw;
+	u32 magic;
+	int ret;
+
+	ret = flash_read(mtd, 0, sizeof(raw), &raw);
+	if(ret)
+		return ret;
+	magic = be32_to_cpu(raw);
+	if(magic != CISCO_CLASSA && magic != CISCO_CLASSB && magic != 0xFFFFFFFF) {
+		if(!(fc->sb_flags & SB_SILENT))
+			pr_warn("no file system found on %s\n", mtd->name);
+		return -EINVAL;
+	}
+
+	ret = scan_chain(sb);
+	if(!ret)
+		ret = build_table(sbi);
+	if(ret)
+		return ret;
+	sbi->chain_end = sbi->tail;
+	/* New files take the class of the card, Class B if it is blank */
+	if(magic == CISCO_CLASSA) {
+		sbi->magic = CISCO_CLASSA;
+		sbi->namemax = 63;
+		sbi->hdrsize = sizeof(struct ca_hdr);
+	} else {
+		sbi->magic = CISCO_CLASSB;
+		sbi->namemax = 47;
+		sbi->hdrsize = sizeof(struct cb_hdr);
+	}
+
+	ret = setup_bdi(sb);
+	if(ret)
+		return ret;
+
+	if(sbi->xip && point_flash(sb))
+		pr_warn("%s does not support xip, reading through the page cache\n", mtd->name);
+
+	sb->s_blocksize = 1024;
+	sb->s_blocksize_bits = 10;
+	sb->s_magic = sbi->magic;
+	sb->s_flags |= SB_NOATIME;
+	sb->s_maxbytes = mtd->size;
+	sbi->next_ino = POS_INO(mtd->size) + 1;
+	if(!(sb->s_flags & SB_RDONLY) && !ciscoffs_writeable(sb)) {
+		pr_notice("%s can not be written, mounting read only\n", mtd->name);
+		sb->s_flags |= SB_RDONLY;
+	}
+	sb->s_time_min = 0;
+	sb->s_time_max = U32_MAX;
+	sb->s_op = &ciscoffs_ops;
+
+	root = ciscoffs_iget(sb, NULL);
+	if(IS_ERR(root))
+		return PTR_ERR(root);
+	sb->s_root = d_make_root(root);
+	if(!sb->s_root)
+		return -ENOMEM;
+
+	pr_debug("%s: %d headers, free space at 0x%08X\n", mtd->name, sbi->count, sbi->tail);
+	return 0;
+}
+
+
+enum {
+	Opt_xip,
+};
+
+static const struct fs_parameter_spec ciscoffs_param_specs[] = {
+	fsparam_flag("xip", Opt_xip),
+	{}
+};
+
+
+/* The options are kept in the ciscoffs_sb, which goes to the superblock */
+static int ciscoffs_parse_param(struct fs_context *fc, struct fs_parameter *param)
+{
+	struct ciscoffs_sb *sbi = fc->s_fs_info;
+	struct fs_parse_result result;
+	int opt;
+
+	opt = fs_parse(fc, ciscoffs_param_specs, param, &result);
+	if(opt < 0)
+		return opt;
+
+	switch(opt) {
+	case Opt_xip:
+		sbi->xip = 1;
+		break;
+	}
+	return 0;
+}
+
+
+static int ciscoffs_get_tree(struct fs_context *fc)
+{
+	return get_tree_mtd(fc, ciscoffs_fill_super);
+}
+
+
+/* xip can only be set at mount */
+static int ciscoffs_reconfigure(struct fs_context *fc)
+{
+	struct super_block *sb = fc->root->d_sb;
+
+	if(!(fc->sb_flags & SB_RDONLY) && !ciscoffs_writeable(sb))
+		return -EROFS;
+	sync_filesystem(sb);
+	return 0;
+}
+
+
+static void ciscoffs_free_fc(struct fs_context *fc)
+{
+	free_sb_info(fc->s_fs_info);
+}
+
+
+static const struct fs_context_operations ciscoffs_context_ops = {
+	.parse_param	= ciscoffs_parse_param,
+	.get_tree	= ciscoffs_get_tree,
+	.reconfigure	= ciscoffs_reconfigure,
+	.free		= ciscoffs_free_fc,
+};
+
+
+static int ciscoffs_init_fs_context(struct fs_context *fc)
+{
+	struct ciscoffs_sb *sbi;
+
+	/* sget hands this to the superblock if it is a new mount */
+	sbi = kzalloc(sizeof(struct ciscoffs_sb), GFP_KERNEL);
+	if(!sbi)
+		return -ENOMEM;
+	mutex_init(&sbi->lock);
+	init_waitqueue_head(&sbi->chain_wait);
+	fc->s_fs_info = sbi;
+	fc->ops = &ciscoffs_context_ops;
+	return 0;
+}
+
+
+/* fill_super may have failed part way, leaving sbi half built */
+static void ciscoffs_kill_sb(struct super_block *sb)
+{
+	struct ciscoffs_sb *sbi = CISCOFFS_SB(sb);
+
+	if(sbi)
+		unpoint_flash(sb);
+	kill_mtd_super(sb);
+	free_sb_info(sbi);
+}
+
+
+static const struct super_operations ciscoffs_ops = {
+	.statfs		= ciscoffs_statfs,
+	.show_stats	= ciscoffs_show_stats,
+};
+
+static const struct file_operations ciscoffs_dir_ops = {
+	.llseek		= generic_file_llseek,
+	.read		= generic_read_dir,
+	.iterate_shared	= ciscoffs_readdir,
+};
+
+static const struct file_operations ciscoffs_file_ops = {
+	.open		= ciscoffs_open,
+	.llseek		= generic_file_llseek,
+	.read_iter	= ciscoffs_read_iter,
+	.write_iter	= ciscoffs_write_iter,
+	.mmap		= ciscoffs_mmap,
+	.splice_read	= ciscoffs_splice_read,
+	.flush		= ciscoffs_flush,
+	.release	= ciscoffs_release,
+};
+
+static const struct inode_operations ciscoffs_dir_inode_ops = {
+	.lookup		= ciscoffs_lookup,
+	.create		= ciscoffs_create,
+	.unlink		= ciscoffs_unlink,
+};
+
+static const struct inode_operations ciscoffs_file_inode_ops = {
+	.setattr	= ciscoffs_setattr,
+};
+
+static const struct address_space_operations ciscoffs_aops = {
+	.read_folio	= ciscoffs_read_folio,
+	.readahead	= ciscoffs_readahead,
+};
+
+static struct file_system_type ciscoffs_fs_type = {
+	.owner		= THIS_MODULE,
+	.name		= "ciscoffs",
+	.init_fs_context = ciscoffs_init_fs_context,
+	.kill_sb	= ciscoffs_kill_sb,
+};
+MODULE_ALIAS_FS("ciscoffs");
+
+
+static int __init init_ciscoffs_fs(void)
+{
+	return register_filesystem(&ciscoffs_fs_type);
+}
+
+
+static void __exit exit_ciscoffs_fs(void)
+{
+	unregister_filesystem(&ciscoffs_fs_type);
+}
+
+
+module_init(init_ciscoffs_fs);
+module_exit(exit_ciscoffs_fs);
+MODULE_DESCRIPTION("Cisco flash file system");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,564 @@
+/*
+ * $Id$
+ *
+ * accel.c - CPU specific versions of the cffs inner loops
+ *
+ * Copyright (C) 2002 Simon Evans (spse@secret.org.uk)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * Please see the file COPYING for more details
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include "accel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define HAVE_X86_SIMD
+# include <immintrin.h>
+#endif
+
+
+/*
+ * The Class B checksum is a ones complement sum of the complement of each
+ * big endian 16 bit word, an odd last byte being padded with a zero.
+ *
+ * Folding the carry back in after every word gives the same result as
+ * taking the exact sum and reducing it modulo 0xffff at the end, except
+ * that a non zero sum never reduces to 0. The fast versions therefore just
+ * add up the words (W) in wide lanes, the complemented sum is then
+ * n * 0xffff - W for n words.
+ */
+static uint16_t chk16_finish(uint16_t chk, size_t len, uint64_t words)
+{
+	uint64_t sum = (uint64_t)((len + 1) / 2) * 0xffff - words + chk;
+
+	if(!sum)
+		return 0;
+	return (uint16_t)(((sum - 1) % 0xffff) + 1);
+}
+
+
+/* Word sum of a short run of bytes, buf must start on an even offset */
+static uint64_t chk16_words_tail(const uint8_t *buf, size_t len)
+{
+	uint64_t words = 0;
+
+	while(len > 1) {
+		words += (buf[0] << 8) | buf[1];
+		buf += 2;
+		len -= 2;
+	}
+	if(len)
+		words += buf[0] << 8;
+	return words;
+}
+
+
+uint16_t chk16_update_ref(uint16_t chk16, const uint8_t *buf, size_t len)
+{
+	uint32_t chk = chk16;
+	uint16_t d;
+	const uint16_t *data;
+
+	data = (const uint16_t *)buf;
+
+	while(len & ~1) {
+		d = ~ntohs(*(data++));
+		chk += (uint16_t)d;
+		chk = (chk & 0xffff) + (chk >> 16);
+		len -= 2;
+	}
+
+	if(len) {
+		chk += (uint16_t)~(*(const uint8_t *)data << 8);
+		chk = (chk & 0xffff) + (chk >> 16);
+	}
+	return (uint16_t)chk;
+}
+
+
+/* Portable version, 8 bytes at a time in 16 bit lanes of a 64 bit word */
+static uint16_t chk16_update_word(uint16_t chk, const uint8_t *buf, size_t len)
+{
+	const uint64_t mask = 0x00ff00ff00ff00ffULL;
+	const uint64_t sum_lanes = 0x0001000100010001ULL;
+	uint64_t words = 0;
+	size_t left = len;
+
+	while(left >= 8) {
+		uint64_t hi = 0, lo = 0, x;
+		int run = 0;
+
+		/* 64 runs of up to 255 per lane keeps a lane sum of all four
+		 * lanes within 16 bits
+		 */
+		while(left >= 8 && run < 64) {
+			memcpy(&x, buf, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			hi += x & mask;
+			lo += (x >> 8) & mask;
+#else
+			hi += (x >> 8) & mask;
+			lo += x & mask;
+#endif
+			buf += 8;
+			left -= 8;
+			run++;
+		}
+		words += ((hi * sum_lanes) >> 48) << 8;
+		words += (lo * sum_lanes) >> 48;
+	}
+	return chk16_finish(chk, len, words + chk16_words_tail(buf, left));
+}
+
+
+size_t find_nonblank_ref(const uint8_t *buf, size_t len)
+{
+	size_t off;
+
+	for(off = 0; off < len; off++) {
+		if(buf[off] != 0xff)
+			break;
+	}
+	return off;
+}
+
+
+/* Compare 32 bytes at a time, then find the byte within them */
+static size_t find_nonblank_word(const uint8_t *buf, size_t len)
+{
+	uint64_t x[4];
+	size_t off = 0;
+
+	while(len - off >= sizeof(x)) {
+		memcpy(x, buf + off, sizeof(x));
+		if(~(x[0] & x[1] & x[2] & x[3]))
+			break;
+		off += sizeof(x);
+	}
+	return off + find_nonblank_ref(buf + off, len - off);
+}
+
+
+/*
+ * CRC-32 as used by Ethernet and zlib, reflected polynomial 0xEDB88320.
+ * The tables are built on first use, crc_tab[0] is the usual byte at a
+ * time table and crc_tab[k] advances a byte through k more zero bytes
+ * for slicing by 8.
+ */
+#define CRC32_POLY 0xedb88320
+
+static uint32_t crc_tab[8][256];
+static pthread_once_t crc_tab_once = PTHREAD_ONCE_INIT;
+
+static void crc32_make_tables(void)
+{
+	uint32_t c;
+	int n, k;
+
+	for(n = 0; n < 256; n++) {
+		c = n;
+		for(k = 0; k < 8; k++)
+			c = (c & 1) ? (c >> 1) ^ CRC32_POLY : c >> 1;
+		crc_tab[0][n] = c;
+	}
+	for(n = 0; n < 256; n++) {
+		c = crc_tab[0][n];
+		for(k = 1; k < 8; k++) {
+			c = crc_tab[0][c & 0xff] ^ (c >> 8);
+			crc_tab[k][n] = c;
+		}
+	}
+}
+
+
+/* The crc register itself, without the inversions at either end */
+static uint32_t crc32_bytes(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	while(len--)
+		crc = crc_tab[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+
+uint32_t crc32_update_ref(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	pthread_once(&crc_tab_once, crc32_make_tables);
+	return ~crc32_bytes(~crc, buf, len);
+}
+
+
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	uint32_t lo, hi;
+
+	while(len >= 8) {
+		memcpy(&lo, buf, 4);
+		memcpy(&hi, buf + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		lo = __builtin_bswap32(lo);
+		hi = __builtin_bswap32(hi);
+#endif
+		lo ^= crc;
+		crc = crc_tab[7][lo & 0xff] ^ crc_tab[6][(lo >> 8) & 0xff] ^
+			crc_tab[5][(lo >> 16) & 0xff] ^ crc_tab[4][lo >> 24] ^
+			crc_tab[3][hi & 0xff] ^ crc_tab[2][(hi >> 8) & 0xff] ^
+			crc_tab[1][(hi >> 16) & 0xff] ^ crc_tab[0][hi >> 24];
+		buf += 8;
+		len -= 8;
+	}
+	return crc32_bytes(crc, buf, len);
+}
+
+
+/* Portable version, 8 bytes at a time */
+static uint32_t crc32_update_slice8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	pthread_once(&crc_tab_once, crc32_make_tables);
+	return ~crc32_slice8(~crc, buf, len);
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+/* Bytes on even offsets are the high bytes of each word, _mm_sad_epu8
+ * adds up 8 bytes at a time into 64 bit lanes.
+ */
+__attribute__((target("sse2")))
+static uint16_t chk16_update_sse2(uint16_t chk, const uint8_t *buf, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i even = _mm_set1_epi16(0x00ff);
+	__m128i hi = zero, all = zero;
+	uint64_t lanes[2], words;
+	size_t left = len;
+
+	while(left >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)buf);
+		hi = _mm_add_epi64(hi, _mm_sad_epu8(_mm_and_si128(v, even), zero));
+		all = _mm_add_epi64(all, _mm_sad_epu8(v, zero));
+		buf += 16;
+		left -= 16;
+	}
+	_mm_storeu_si128((__m128i *)lanes, hi);
+	words = (lanes[0] + lanes[1]) << 8;
+	_mm_storeu_si128((__m128i *)lanes, _mm_sub_epi64(all, hi));
+	words += lanes[0] + lanes[1];
+
+	return chk16_finish(chk, len, words + chk16_words_tail(buf, left));
+}
+
+
+__attribute__((target("avx2")))
+static uint16_t chk16_update_avx2(uint16_t chk, const uint8_t *buf, size_t len)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i even = _mm256_set1_epi16(0x00ff);
+	__m256i hi = zero, all = zero;
+	uint64_t lanes[4], words;
+	size_t left = len;
+
+	while(left >= 64) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)buf);
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(buf + 32));
+		hi = _mm256_add_epi64(hi, _mm256_sad_epu8(_mm256_and_si256(v0, even), zero));
+		all = _mm256_add_epi64(all, _mm256_sad_epu8(v0, zero));
+		hi = _mm256_add_epi64(hi, _mm256_sad_epu8(_mm256_and_si256(v1, even), zero));
+		all = _mm256_add_epi64(all, _mm256_sad_epu8(v1, zero));
+		buf += 64;
+		left -= 64;
+	}
+	_mm256_storeu_si256((__m256i *)lanes, hi);
+	words = (lanes[0] + lanes[1] + lanes[2] + lanes[3]) << 8;
+	_mm256_storeu_si256((__m256i *)lanes, _mm256_sub_epi64(all, hi));
+	words += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+	return chk16_finish(chk, len, words + chk16_words_tail(buf, left));
+}
+
+
+/* Blank (erased) flash reads as all ones */
+__attribute__((target("sse2")))
+static size_t find_nonblank_sse2(const uint8_t *buf, size_t len)
+{
+	const __m128i ones = _mm_set1_epi8(-1);
+	size_t off = 0;
+
+	while(len - off >= 64) {
+		__m128i v = _mm_and_si128(
+			_mm_and_si128(_mm_loadu_si128((const __m128i *)(buf + off)),
+				      _mm_loadu_si128((const __m128i *)(buf + off + 16))),
+			_mm_and_si128(_mm_loadu_si128((const __m128i *)(buf + off + 32)),
+				      _mm_loadu_si128((const __m128i *)(buf + off + 48))));
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones)) != 0xffff)
+			break;
+		off += 64;
+	}
+	while(len - off >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + off));
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones)) != 0xffff)
+			break;
+		off += 16;
+	}
+	return off + find_nonblank_ref(buf + off, len - off);
+}
+
+
+__attribute__((target("avx2")))
+static size_t find_nonblank_avx2(const uint8_t *buf, size_t len)
+{
+	const __m256i ones = _mm256_set1_epi8(-1);
+	size_t off = 0;
+
+	while(len - off >= 128) {
+		__m256i v = _mm256_and_si256(
+			_mm256_and_si256(_mm256_loadu_si256((const __m256i *)(buf + off)),
+					 _mm256_loadu_si256((const __m256i *)(buf + off + 32))),
+			_mm256_and_si256(_mm256_loadu_si256((const __m256i *)(buf + off + 64)),
+					 _mm256_loadu_si256((const __m256i *)(buf + off + 96))));
+		if(!_mm256_testc_si256(v, ones))
+			break;
+		off += 128;
+	}
+	while(len - off >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + off));
+		if(!_mm256_testc_si256(v, ones))
+			break;
+		off += 32;
+	}
+	return off + find_nonblank_ref(buf + off, len - off);
+}
+
+
+/*
+ * CRC-32 by folding with carry-less multiplies, after Intel's "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ". 64 bytes are
+ * folded at a time in four lanes, the lanes are folded into one and the
+ * last 128 bits are reduced to 32 with a Barrett reduction. The SSE4.2
+ * crc32 instruction only does the Castagnoli polynomial so is no use here.
+ * The constants are for the reflected polynomial, k1 and k2 fold by 512
+ * bits, k3 and k4 by 128 bits and k5 by 64 bits.
+ */
+__attribute__((target("pclmul,sse2")))
+static uint32_t crc32_fold(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x1c6e41596ULL, 0x154442bd4ULL);
+	const __m128i k3k4 = _mm_set_epi64x(0x0ccaa009eULL, 0x1751997d0ULL);
+	const __m128i k5 = _mm_set_epi64x(0, 0x163cd6124ULL);
+	const __m128i poly_mu = _mm_set_epi64x(0x1f7011641ULL, 0x1db710641ULL);
+	const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+	__m128i x0, x1, x2, x3, t;
+
+	x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)buf), _mm_cvtsi32_si128(crc));
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 16));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 32));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 48));
+	buf += 64;
+	len -= 64;
+
+#define FOLD(x, k, data) \
+	t = _mm_clmulepi64_si128(x, k, 0x11); \
+	x = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), t), data)
+
+	while(len >= 64) {
+		FOLD(x0, k1k2, _mm_loadu_si128((const __m128i *)buf));
+		FOLD(x1, k1k2, _mm_loadu_si128((const __m128i *)(buf + 16)));
+		FOLD(x2, k1k2, _mm_loadu_si128((const __m128i *)(buf + 32)));
+		FOLD(x3, k1k2, _mm_loadu_si128((const __m128i *)(buf + 48)));
+		buf += 64;
+		len -= 64;
+	}
+
+	FOLD(x0, k3k4, x1);
+	FOLD(x0, k3k4, x2);
+	FOLD(x0, k3k4, x3);
+	while(len >= 16) {
+		FOLD(x0, k3k4, _mm_loadu_si128((const __m128i *)buf));
+		buf += 16;
+		len -= 16;
+	}
+#undef FOLD
+
+	/* 128 bits to 64 */
+	x0 = _mm_xor_si128(_mm_clmulepi64_si128(x0, k3k4, 0x10), _mm_srli_si128(x0, 8));
+
+	/* 64 bits to 32 */
+	t = _mm_srli_si128(x0, 4);
+	x0 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x0, mask32), k5, 0x00), t);
+
+	/* Barrett reduction */
+	t = x0;
+	x0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), poly_mu, 0x10);
+	x0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), poly_mu, 0x00);
+	x0 = _mm_xor_si128(x0, t);
+	crc = _mm_cvtsi128_si32(_mm_srli_si128(x0, 4));
+
+	return crc32_slice8(crc, buf, len);
+}
+
+
+static uint32_t crc32_update_pclmul(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	pthread_once(&crc_tab_once, crc32_make_tables);
+	crc = ~crc;
+	if(len >= 64)
+		crc = crc32_fold(crc, buf, len);
+	else
+		crc = crc32_slice8(crc, buf, len);
+	return ~crc;
+}
+
+
+static int have_sse2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+
+static int have_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+
+static int have_pclmul(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2") && __builtin_cpu_supports("pclmul");
+}
+
+#endif /* HAVE_X86_SIMD */
+
+
+static int always(void)
+{
+	return 1;
+}
+
+
+/* In order of preference, best last. Each table has the same entries */
+const struct chk16_impl chk16_impls[] = {
+	{ "ref",	chk16_update_ref,	always },
+	{ "word",	chk16_update_word,	always },
+#ifdef HAVE_X86_SIMD
+	{ "sse2",	chk16_update_sse2,	have_sse2 },
+	{ "avx2",	chk16_update_avx2,	have_avx2 },
+#endif
+	{ NULL, NULL, NULL }
+};
+
+const struct blank_impl blank_impls[] = {
+	{ "ref",	find_nonblank_ref,	always },
+	{ "word",	find_nonblank_word,	always },
+#ifdef HAVE_X86_SIMD
+	{ "sse2",	find_nonblank_sse2,	have_sse2 },
+	{ "avx2",	find_nonblank_avx2,	have_avx2 },
+#endif
+	{ NULL, NULL, NULL }
+};
+
+/* The CRC versions go by their own names */
+const struct crc32_impl crc32_impls[] = {
+	{ "ref",	crc32_update_ref,	always },
+	{ "slice8",	crc32_update_slice8,	always },
+#ifdef HAVE_X86_SIMD
+	{ "pclmul",	crc32_update_pclmul,	have_pclmul },
+#endif
+	{ NULL, NULL, NULL }
+};
+
+
+static int chk16_idx, crc32_idx;
+
+
+/* Index of the best version the CPU supports */
+static int accel_best(void)
+{
+	char *force = getenv("CFFS_ACCEL");
+	int idx, best = 0;
+
+	for(idx = 0; chk16_impls[idx].name; idx++) {
+		if(!chk16_impls[idx].supported())
+			continue;
+		/* CFFS_ACCEL can force a particular version */
+		if(force && !strcmp(force, chk16_impls[idx].name)) {
+			best = idx;
+			break;
+		}
+		best = idx;
+	}
+	return best;
+}
+
+
+const char *accel_impl_name(void)
+{
+	return chk16_impls[chk16_idx].name;
+}
+
+
+/* CFFS_ACCEL may name a CRC version, ref forces the reference one too */
+static int crc32_best(void)
+{
+	char *force = getenv("CFFS_ACCEL");
+	int idx, best = 0;
+
+	for(idx = 0; crc32_impls[idx].name; idx++) {
+		if(!crc32_impls[idx].supported())
+			continue;
+		if(force && !strcmp(force, crc32_impls[idx].name)) {
+			best = idx;
+			break;
+		}
+		best = idx;
+	}
+	return best;
+}
+
+
+const char *crc32_impl_name(void)
+{
+	return crc32_impls[crc32_idx].name;
+}
+
+
+chk16_fn chk16_update = chk16_update_ref;
+blank_fn find_nonblank = find_nonblank_ref;
+crc32_fn crc32_update = crc32_update_ref;
+
+
+/* Pick the versions before main, so no thread can see them change */
+__attribute__((constructor)) static void accel_init(void)
+{
+	chk16_idx = accel_best();
+	chk16_update = chk16_impls[chk16_idx].fn;
+	find_nonblank = blank_impls[chk16_idx].fn;
+	crc32_idx = crc32_best();
+	crc32_update = crc32_impls[crc32_idx].fn;
+}
+
+
+uint16_t calc_chk16(const uint8_t *buf, size_t len)
+{
+	return chk16_update(0, buf, len);
+}
+
+
+uint32_t calc_crc32(const uint8_t *buf, size_t len)
+{
+	return crc32_update(0, buf, len);
+}
@@ -0,0 +1,68 @@
+/*
+ * $Id$
+ *
+ * CPU specific versions of the cffs inner loops
+ *
+ */
+
+#ifndef CFFS_ACCEL_H
+#define CFFS_ACCEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+typedef uint16_t (*chk16_fn)(uint16_t chk, const uint8_t *buf, size_t len);
+
+struct chk16_impl {
+	const char	*name;
+	chk16_fn	fn;
+	int		(*supported)(void);
+};
+
+/* All implementations, the scalar reference first. Terminated by a NULL name */
+extern const struct chk16_impl chk16_impls[];
+
+/* Reference version, one word at a time */
+uint16_t chk16_update_ref(uint16_t chk, const uint8_t *buf, size_t len);
+
+/* Returns the offset of the first byte that is not 0xff, or len */
+typedef size_t (*blank_fn)(const uint8_t *buf, size_t len);
+
+struct blank_impl {
+	const char	*name;
+	blank_fn	fn;
+	int		(*supported)(void);
+};
+
+extern const struct blank_impl blank_impls[];
+
+size_t find_nonblank_ref(const uint8_t *buf, size_t len);
+
+/* Class A CRC, the usual CRC-32 (as zlib). Updates a finished crc, so
+ * starting from 0 and feeding the data in pieces gives the crc of it all.
+ */
+typedef uint32_t (*crc32_fn)(uint32_t crc, const uint8_t *buf, size_t len);
+
+struct crc32_impl {
+	const char	*name;
+	crc32_fn	fn;
+	int		(*supported)(void);
+};
+
+extern const struct crc32_impl crc32_impls[];
+
+/* Reference version, one byte at a time */
+uint32_t crc32_update_ref(uint32_t crc, const uint8_t *buf, size_t len);
+
+/* Best implementations for this CPU, chosen when the program starts */
+extern chk16_fn chk16_update;
+extern blank_fn find_nonblank;
+extern crc32_fn crc32_update;
+const char *accel_impl_name(void);
+const char *crc32_impl_name(void);
+
+uint16_t calc_chk16(const uint8_t *buf, size_t len);
+uint32_t calc_crc32(const uint8_t *buf, size_t len);
+
+#endif
@@ -0,0 +1,324 @@
+/*
+ * $Id$
+ *
+ * backend.c - MTD, image file and NOR emulator access to the flash
+ *
+ * Copyright (C) 2002 Simon Evans (spse@secret.org.uk)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * Please see the file COPYING for more details
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <linux/kdev_t.h>
+#include <linux/mtd/mtd.h>
+
+#include "backend.h"
+
+
+/* Largest piece the NOR emulator checks and programs at once */
+#define EMUL_CHUNK (64<<10)
+
+
+static int fd_read(struct cffs_dev *dev, off_t pos, void *buf, size_t len)
+{
+	ssize_t red;
+
+	while(len) {
+		red = pread(dev->fd, buf, len, pos);
+		if(red == -1 && errno == EINTR)
+			continue;
+		if(red <= 0)
+			return -1;
+		buf = (char *)buf + red;
+		pos += red;
+		len -= red;
+	}
+	return 0;
+}
+
+
+static int fd_write(struct cffs_dev *dev, off_t pos, const void *buf, size_t len)
+{
+	ssize_t wrote;
+
+	while(len) {
+		wrote = pwrite(dev->fd, buf, len, pos);
+		if(wrote == -1 && errno == EINTR)
+			continue;
+		if(wrote <= 0)
+			return -1;
+		buf = (const char *)buf + wrote;
+		pos += wrote;
+		len -= wrote;
+	}
+	return 0;
+}
+
+
+static int mtd_erase(struct cffs_dev *dev, off_t start, off_t len)
+{
+	struct erase_info_user erase;
+
+	erase.start = start;
+	erase.length = len;
+	return ioctl(dev->fd, MEMERASE, &erase);
+}
+
+
+/* Image files are erased by filling the range with 0xFF */
+static int image_erase(struct cffs_dev *dev, off_t start, off_t len)
+{
+	uint8_t *blank;
+	size_t part;
+	int ret = 0;
+
+	part = (len > dev->erasesize) ? dev->erasesize : len;
+	blank = malloc(part);
+	if(!blank)
+		return -1;
+	memset(blank, 0xff, part);
+	while(len && !ret) {
+		if((off_t)part > len)
+			part = len;
+		ret = fd_write(dev, start, blank, part);
+		start += part;
+		len -= part;
+	}
+	free(blank);
+	return ret;
+}
+
+
+/* Sleep off the emulated time once there is at least a millisecond of it */
+static void emul_delay(struct nor_emul *emul, int64_t ns)
+{
+	struct timespec ts;
+
+	emul->owed_ns += ns;
+	emul->total_ns += ns;
+	if(emul->owed_ns < 1000000)
+		return;
+	ts.tv_sec = emul->owed_ns / 1000000000;
+	ts.tv_nsec = emul->owed_ns % 1000000000;
+	emul->owed_ns = 0;
+	while(nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+
+/* Programming NOR flash can only change bits from 1 to 0, a write that
+ * needs a 0 changed back to 1 fails as the real part would.
+ */
+static int nor_write(struct cffs_dev *dev, off_t pos, const void *buf, size_t len)
+{
+	const uint8_t *data = buf;
+	uint8_t *old, *cur;
+	size_t part, off;
+
+	*dev->emul->fault = '\0';
+	old = malloc(EMUL_CHUNK);
+	if(!old)
+		return -1;
+
+	while(len) {
+		part = (len > EMUL_CHUNK) ? EMUL_CHUNK : len;
+		if(dev->map) {
+			cur = dev->map + pos;
+		} else {
+			cur = old;
+			if(fd_read(dev, pos, old, part) == -1)
+				goto write_err;
+		}
+		for(off = 0; off < part; off++) {
+			if((cur[off] & data[off]) != data[off]) {
+				snprintf(dev->emul->fault, sizeof(dev->emul->fault),
+					 "NOR emulator: write to 0x%8.8lX needs an erase "
+					 "(0x%2.2X over 0x%2.2X)", (unsigned long)(pos + off),
+					 data[off], cur[off]);
+				errno = EIO;
+				goto write_err;
+			}
+		}
+		if(fd_write(dev, pos, data, part) == -1)
+			goto write_err;
+		dev->emul->programmed += part;
+		emul_delay(dev->emul, (int64_t)part * dev->emul->prog_ns);
+		pos += part;
+		data += part;
+		len -= part;
+	}
+	free(old);
+	return 0;
+
+ write_err:
+	free(old);
+	return -1;
+}
+
+
+/* Whole blocks only, as the hardware does */
+static int nor_erase(struct cffs_dev *dev, off_t start, off_t len)
+{
+	off_t blocks;
+
+	if(start % dev->erasesize || (len % dev->erasesize && start + len != dev->size)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(image_erase(dev, start, len) == -1)
+		return -1;
+	blocks = (len + dev->erasesize - 1) / dev->erasesize;
+	dev->emul->erased += blocks;
+	emul_delay(dev->emul, blocks * dev->emul->erase_us * 1000LL);
+	return 0;
+}
+
+
+static const struct dev_ops mtd_ops = { "mtd", fd_read, fd_write, mtd_erase };
+static const struct dev_ops image_ops = { "image", fd_read, fd_write, image_erase };
+static const struct dev_ops nor_ops = { "nor emulator", fd_read, nor_write, nor_erase };
+
+
+int dev_read(struct cffs_dev *dev, off_t pos, void *buf, size_t len)
+{
+	if(pos < 0 || pos + (off_t)len > dev->size)
+		return -1;
+
+	if(dev->map) {
+		memcpy(buf, dev->map + pos, len);
+		return 0;
+	}
+	return dev->ops->read(dev, pos, buf, len);
+}
+
+
+int dev_write(struct cffs_dev *dev, off_t pos, const void *buf, size_t len)
+{
+	return dev->ops->write(dev, pos, buf, len);
+}
+
+
+int dev_erase(struct cffs_dev *dev, off_t start, off_t len)
+{
+	return dev->ops->erase(dev, start, len);
+}
+
+
+int open_device(const char *device, int mode, struct cffs_dev *dev, struct nor_emul *emul)
+{
+	struct stat sinfo;
+	struct mtd_info_user mtd;
+	void *map;
+	int err;
+
+	memset(dev, 0, sizeof(struct cffs_dev));
+	dev->fd = open(device, mode);
+	if(dev->fd == -1)
+		return -1;
+	if(fstat(dev->fd, &sinfo) == -1)
+		goto open_err;
+
+	if(S_ISCHR(sinfo.st_mode) && (MAJOR(sinfo.st_rdev) == MTD_CHAR_MAJOR)) {
+		/* Only image files can be emulated */
+		if(emul) {
+			errno = EINVAL;
+			goto open_err;
+		}
+		if(ioctl(dev->fd, MEMGETINFO, &mtd) == -1)
+			goto open_err;
+		dev->is_mtd = 1;
+		dev->ops = &mtd_ops;
+		dev->size = mtd.size;
+		dev->erasesize = mtd.erasesize;
+	} else if(S_ISREG(sinfo.st_mode)) {
+		dev->ops = &image_ops;
+		dev->size = sinfo.st_size;
+		dev->erasesize = IMAGE_ERASESIZE;
+		if(emul) {
+			dev->ops = &nor_ops;
+			dev->emul = emul;
+			if(emul->erasesize)
+				dev->erasesize = emul->erasesize;
+		}
+	} else {
+		errno = ENODEV;
+		goto open_err;
+	}
+
+	/* Not all MTD drivers support mmap, fall back to pread if not */
+	if(dev->size > 0 && (off_t)(size_t)dev->size == dev->size) {
+		map = mmap(NULL, dev->size, PROT_READ, MAP_SHARED, dev->fd, 0);
+		if(map != MAP_FAILED)
+			dev->map = map;
+	}
+	return 0;
+
+ open_err:
+	err = errno;
+	close(dev->fd);
+	dev->fd = -1;
+	errno = err;
+	return -1;
+}
+
+
+void close_device(struct cffs_dev *dev)
+{
+	dev->emul = NULL;
+	if(dev->map)
+		munmap(dev->map, dev->size);
+	dev->map = NULL;
+	if(dev->fd != -1)
+		close(dev->fd);
+	dev->fd = -1;
+	free(dev->iobuf);
+	dev->iobuf = NULL;
+}
+
+
+static long parse_num(char *arg, char **end)
+{
+	long num = strtol(arg, end, 0);
+
+	if(**end == 'k' || **end == 'K') {
+		num <<= 10;
+		(*end)++;
+	}
+	return num;
+}
+
+
+int parse_emul(char *arg, struct nor_emul *emul)
+{
+	char *end;
+
+	memset(emul, 0, sizeof(struct nor_emul));
+	emul->prog_ns = parse_num(arg, &end);
+	if(*end != ':')
+		return -1;
+	emul->erase_us = parse_num(end + 1, &end);
+	if(*end == ':')
+		emul->erasesize = parse_num(end + 1, &end);
+	if(*end || emul->prog_ns < 0 || emul->erase_us < 0 || (int32_t)emul->erasesize < 0)
+		return -1;
+	return 0;
+}
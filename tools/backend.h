@@ -0,0 +1,69 @@
+/*
+ * $Id$
+ *
+ * Access to the flash, either an MTD char device, an image file or an
+ * image file made to behave like NOR flash
+ *
+ */
+
+#ifndef CFFS_BACKEND_H
+#define CFFS_BACKEND_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Erase size assumed for image files */
+#define IMAGE_ERASESIZE (128<<10)
+
+struct cffs_dev;
+
+/* Each returns 0 or -1 with errno set */
+struct dev_ops {
+	const char	*name;
+	int		(*read)(struct cffs_dev *dev, off_t pos, void *buf, size_t len);
+	int		(*write)(struct cffs_dev *dev, off_t pos, const void *buf, size_t len);
+	int		(*erase)(struct cffs_dev *dev, off_t start, off_t len);
+};
+
+/* NOR flash emulation, programming can only clear bits and erasing sets
+ * a whole block to 0xFF. Each takes the time given.
+ */
+struct nor_emul {
+	long		prog_ns;	/* per byte programmed */
+	long		erase_us;	/* per block erased */
+	uint32_t	erasesize;	/* 0 for IMAGE_ERASESIZE */
+	uint64_t	programmed;	/* bytes */
+	uint64_t	erased;		/* blocks */
+	int64_t		owed_ns;	/* delay not yet slept */
+	int64_t		total_ns;
+	char		fault[96];	/* why the last write failed */
+};
+
+/* An open flash device or image file */
+struct cffs_dev {
+	int		fd;
+	int		is_mtd;		/* MTD char device, otherwise an image file */
+	const struct dev_ops *ops;
+	struct nor_emul	*emul;		/* set for the NOR emulator */
+	uint8_t		*map;		/* mapping of the whole device or NULL */
+	off_t		size;		/* size in bytes */
+	uint32_t	erasesize;
+	uint8_t		*iobuf;		/* STREAM_BUF_SZ buffer reused by stream_file() */
+};
+
+/* Open an MTD char device or an image file and map it if possible. An
+ * image file is run through the NOR emulator if emul is not NULL. Returns
+ * -1 with errno set, ENODEV if it is not a device or image file.
+ */
+int open_device(const char *device, int mode, struct cffs_dev *dev, struct nor_emul *emul);
+void close_device(struct cffs_dev *dev);
+
+/* Parse PROG_NS:ERASE_US[:ERASESIZE] */
+int parse_emul(char *arg, struct nor_emul *emul);
+
+int dev_read(struct cffs_dev *dev, off_t pos, void *buf, size_t len);
+int dev_write(struct cffs_dev *dev, off_t pos, const void *buf, size_t len);
+int dev_erase(struct cffs_dev *dev, off_t start, off_t len);
+
+#endif
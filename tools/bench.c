@@ -0,0 +1,353 @@
+/*
+ * $Id$
+ *
+ * bench.c - timings for the cffs inner loops
+ *
+ * Copyright (C) 2002 Simon Evans (spse@secret.org.uk)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * Please see the file COPYING for more details
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fileheader.h"
+#include "header.h"
+#include "accel.h"
+
+
+/*
+ * Each test is run in batches of enough iterations to take at least
+ * MIN_BATCH_NS, and the median and spread of the batches is reported.
+ * The spread is (slowest - fastest) / median, a large one means the
+ * figures are not to be trusted.
+ */
+#define MIN_BATCH_NS	50000000LL
+
+struct bench {
+	const char	*name;
+	void		(*fn)(struct bench *b, long iters);
+	size_t		bytes;		/* bytes handled per iteration */
+	long		items;		/* headers handled per iteration */
+	const uint8_t	*buf;
+	size_t		len;
+	void		*impl;
+};
+
+static int reps = 7;
+static volatile uint32_t sink;
+
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+
+static void run_bench(struct bench *b)
+{
+	long long *times, start, t;
+	long iters = 1;
+	double med, spread;
+	int cnt;
+
+	times = malloc(reps * sizeof(long long));
+	if(!times) {
+		perror("malloc: ");
+		exit(1);
+	}
+
+	/* Warm up and find a batch size */
+	while(1) {
+		start = now_ns();
+		b->fn(b, iters);
+		t = now_ns() - start;
+		if(t >= MIN_BATCH_NS || iters >= (1L << 30))
+			break;
+		iters *= (t > 0 && MIN_BATCH_NS / t < 16) ? MIN_BATCH_NS / t + 1 : 16;
+	}
+
+	for(cnt = 0; cnt < reps; cnt++) {
+		start = now_ns();
+		b->fn(b, iters);
+		times[cnt] = now_ns() - start;
+	}
+	qsort(times, reps, sizeof(long long), cmp_ll);
+	med = (double)times[reps / 2] / iters;
+	spread = 100.0 * (times[reps - 1] - times[0]) / times[reps / 2];
+
+	printf("%-16s", b->name);
+	if(b->bytes)
+		printf(" %10.1f MB/s", b->bytes / med * 1e9 / (1 << 20));
+	else
+		printf(" %15s", "");
+	if(b->items)
+		printf(" %10.1f ns/header", med / b->items);
+	else
+		printf(" %20s", "");
+	printf("  spread %.1f%%\n", spread);
+	free(times);
+}
+
+
+static void bench_chk16(struct bench *b, long iters)
+{
+	chk16_fn fn = (chk16_fn)b->impl;
+
+	while(iters--)
+		sink += fn(0, b->buf, b->len);
+}
+
+
+static void bench_crc32(struct bench *b, long iters)
+{
+	crc32_fn fn = (crc32_fn)b->impl;
+
+	while(iters--)
+		sink += fn(0, b->buf, b->len);
+}
+
+
+static void bench_blank(struct bench *b, long iters)
+{
+	blank_fn fn = (blank_fn)b->impl;
+
+	while(iters--)
+		sink += fn(b->buf, b->len);
+}
+
+
+/* Decode the same header over and over, as read_header does */
+static void bench_decode(struct bench *b, long iters)
+{
+	struct cffs_hdr header;
+	long cnt;
+
+	while(iters--) {
+		for(cnt = 0; cnt < b->items; cnt++) {
+			decode_header(b->buf, b->len, 0, &header);
+			sink += header.hdr.cbfh.length;
+		}
+	}
+}
+
+
+/* Follow the header chain through an image in memory, as a scan of a
+ * mapped device does
+ */
+static void bench_walk(struct bench *b, long iters)
+{
+	struct cffs_hdr header;
+	off_t pos;
+
+	while(iters--) {
+		pos = 0;
+		while(pos < (off_t)b->len &&
+		      decode_header(b->buf + pos, b->len - pos, pos, &header) == 0)
+			pos = next_header_pos(&header);
+		sink += pos;
+	}
+}
+
+
+/* Lay out files of random lengths up to 2 * avg bytes until len is used.
+ * Returns the number of headers written, the rest of the image is blank.
+ */
+static long make_image(uint8_t *img, size_t len, size_t avg)
+{
+	struct cffs_hdr header;
+	char name[32];
+	off_t pos = 0;
+	size_t size;
+	long count = 0;
+
+	memset(img, 0xff, len);
+	while(1) {
+		size = rand() % (2 * avg + 1);
+		if(pos + sizeof(struct cb_hdr) + size > len)
+			break;
+		sprintf(name, "file%ld", count);
+		make_header(&header, CISCO_CLASSB, pos, name, size);
+		encode_header(&header, img + pos);
+		memset(img + pos + sizeof(struct cb_hdr), count & 0x7f, size);
+		pos = next_header_pos(&header);
+		count++;
+	}
+	return count;
+}
+
+
+static void usage(void)
+{
+	printf("Usage: cffs-bench [-s SIZE] [-f FILESIZE] [-r REPS]\n");
+	printf("\t-s SIZE\t\tBytes of data to checksum and scan, default 4M\n");
+	printf("\t-f FILESIZE\tAverage file size in the header chain, default 4k\n");
+	printf("\t-r REPS\t\tTimed repetitions of each test, default 7\n");
+	printf("SIZE and FILESIZE may end in k or M\n");
+}
+
+
+static size_t parse_size(char *arg)
+{
+	char *end;
+	size_t size = strtoul(arg, &end, 0);
+
+	if(*end == 'k' || *end == 'K')
+		size <<= 10;
+	else if(*end == 'M' || *end == 'm')
+		size <<= 20;
+	return size;
+}
+
+
+int main(int argc, char **argv)
+{
+	struct bench b;
+	struct cffs_hdr header;
+	uint8_t *data, *blank, *img, hbuf[sizeof(struct ca_hdr)];
+	size_t size = 4 << 20, avg = 4096, cnt;
+	uint32_t want;
+	long headers;
+	char name[32];
+	int a, idx, bad = 0;
+
+	while((a = getopt(argc, argv, "s:f:r:h")) != -1) {
+		switch(a) {
+		case 's':
+			size = parse_size(optarg);
+			break;
+		case 'f':
+			avg = parse_size(optarg);
+			break;
+		case 'r':
+			reps = atoi(optarg);
+			break;
+		default:
+			usage();
+			exit(a == 'h' ? 0 : 1);
+		}
+	}
+	if(!size || reps < 1) {
+		usage();
+		exit(1);
+	}
+
+	data = malloc(size);
+	blank = malloc(size);
+	img = malloc(size);
+	if(!data || !blank || !img) {
+		perror("malloc: ");
+		exit(1);
+	}
+	srand(1);
+	for(cnt = 0; cnt < size; cnt++)
+		data[cnt] = rand();
+	memset(blank, 0xff, size);
+	headers = make_image(img, size, avg);
+
+	printf("%lu bytes of data, %ld headers, %d repetitions\n", (unsigned long)size,
+	       headers, reps);
+	printf("Default versions: %s, crc %s\n", accel_impl_name(), crc32_impl_name());
+
+	memset(&b, 0, sizeof(b));
+	b.buf = data;
+	b.len = size;
+	b.bytes = size;
+	want = chk16_update_ref(0, data, size);
+	for(idx = 0; chk16_impls[idx].name; idx++) {
+		if(!chk16_impls[idx].supported())
+			continue;
+		if(chk16_impls[idx].fn(0, data, size) != want) {
+			fprintf(stderr, "chk16 %s gives the wrong answer\n", chk16_impls[idx].name);
+			bad = 1;
+			continue;
+		}
+		snprintf(name, sizeof(name), "chk16/%s", chk16_impls[idx].name);
+		b.name = name;
+		b.fn = bench_chk16;
+		b.impl = (void *)chk16_impls[idx].fn;
+		run_bench(&b);
+	}
+
+	want = crc32_update_ref(0, data, size);
+	for(idx = 0; crc32_impls[idx].name; idx++) {
+		if(!crc32_impls[idx].supported())
+			continue;
+		if(crc32_impls[idx].fn(0, data, size) != want) {
+			fprintf(stderr, "crc32 %s gives the wrong answer\n", crc32_impls[idx].name);
+			bad = 1;
+			continue;
+		}
+		snprintf(name, sizeof(name), "crc32/%s", crc32_impls[idx].name);
+		b.name = name;
+		b.fn = bench_crc32;
+		b.impl = (void *)crc32_impls[idx].fn;
+		run_bench(&b);
+	}
+
+	b.buf = blank;
+	for(idx = 0; blank_impls[idx].name; idx++) {
+		if(!blank_impls[idx].supported())
+			continue;
+		blank[size - 1] = 0;
+		if(blank_impls[idx].fn(blank, size) != size - 1) {
+			fprintf(stderr, "blank %s gives the wrong answer\n", blank_impls[idx].name);
+			bad = 1;
+			blank[size - 1] = 0xff;
+			continue;
+		}
+		blank[size - 1] = 0xff;
+		snprintf(name, sizeof(name), "blank/%s", blank_impls[idx].name);
+		b.name = name;
+		b.fn = bench_blank;
+		b.impl = (void *)blank_impls[idx].fn;
+		run_bench(&b);
+	}
+
+	make_header(&header, CISCO_CLASSB, 0, "running-config", 1000);
+	b.name = "decode";
+	b.fn = bench_decode;
+	b.buf = hbuf;
+	b.len = encode_header(&header, hbuf);
+	b.bytes = 0;
+	b.items = 1000;
+	run_bench(&b);
+
+	if(headers) {
+		b.name = "walk";
+		b.fn = bench_walk;
+		b.buf = img;
+		b.len = size;
+		b.bytes = size;
+		b.items = headers;
+		run_bench(&b);
+	}
+
+	free(data);
+	free(blank);
+	free(img);
+	return bad;
+}
@@ -24,6 +24,7 @@
  */
 
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,14 +36,9 @@
 #include <fnmatch.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <netinet/in.h> 
-#include <sys/ioctl.h>
-
-#include <linux/kdev_t.h>
-#include <linux/mtd/mtd.h>
+#include <pthread.h>
 
 
-#define _GNU_SOURCE
 #ifdef HAVE_GETOPT_LONG
 # include <getopt.h>
 #else
@@ -50,13 +46,63 @@
 #endif
 
 
-#include "fileheader.h"
+#include "libcffs.h"
 
 
 #define COPYRIGHT "(C) Simon Evans 2002 (spse@secret.org.uk)"
 
-enum options {	none = 0, bad_options, dir, delete, erase, get, put, fsck, help, version };
-	
+enum options {	none = 0, bad_options, dir, list, delete, erase, get, put, fsck, batch, help, version };
+
+/* Options that modify the main option, any number can be given */
+struct modifiers {
+	int	check;		/* verify checksums in --list and --get */
+	int	jobs;		/* worker threads for --fsck */
+	char	*index;		/* sidecar header index file */
+	int	quick;		/* only erase blocks that are not blank */
+	struct nor_emul *emul;	/* run an image file through the NOR emulator */
+	char	*script;	/* command file for --batch */
+	char	**devices;	/* every device given */
+	int	devcnt;
+	int	parallel;	/* devices worked on at once */
+	int	yes;		/* dont ask for confirmation */
+	int	class_a;	/* allow putting Class A files */
+};
+
+/* One line of a --batch command file */
+struct batch_cmd {
+	enum options	option;
+	int		filecnt;
+	char		**files;
+};
+
+/* The work to do on each device */
+struct job {
+	enum options	option;
+	struct modifiers *mods;
+	int		filecnt;
+	char		**files;
+	struct batch_cmd *cmds;		/* for --batch */
+	int		count;
+	int		rdwr;		/* open the devices for writing */
+	int		gets;		/* files are saved from the devices */
+};
+
+/* One device being worked on. With more than one device the output for
+ * each is collected in buf and printed once it is finished.
+ */
+struct run {
+	char		*device;
+	cffs_t		*h;
+	FILE		*out;
+	FILE		*err;
+	int		multi;		/* no prompts or progress */
+	int		dirfd;		/* --get saves files here */
+	struct nor_emul	emul;
+	char		*buf;
+	size_t		len;
+	int		ret;
+	int		done;
+};
 
 
 /* Used by getopt */
@@ -64,29 +110,6 @@ extern char *optarg;
 extern int optind, opterr, optopt;  
 
 
-/* 16bit check sum calculation */
-uint16_t calc_chk16(uint8_t *buf, int len)
-{
-	uint32_t chk = 0;
-	uint16_t d, *data;
-	
-	data = (uint16_t *)buf;
-
-	while(len & ~1) {
-		d = ~ntohs(*(data++));
-		chk += (uint16_t)d;
-		chk = (chk & 0xffff) + (chk >> 16);
-		len -= 2;
-	}
-
-	if(len) {
-		chk += (uint16_t)~(*data << 8);
-		chk = (chk & 0xffff) + (chk >> 16);
-	}
-	return (uint16_t)chk;
-}
-
-
 int file_match(int filecnt, char **files, struct cffs_hdr *header)
 {
 	char *name;
@@ -122,352 +145,60 @@ int confirm_action(char *action)
 }
 	
 
-char *read_file(int fd, struct cffs_hdr *header, int *filelen) 
-{
-	int len, hlen;
-	char *buf;
-	
-	*filelen = 0;
-
-	if(header->magic == CISCO_CLASSB) {
-		len = header->hdr.cbfh.length;
-		hlen = sizeof(struct cb_hdr);
-	} else {
-		len = header->hdr.cafh.length;
-		hlen = sizeof(struct ca_hdr);
-	}
-	if(lseek(fd, header->pos+hlen, SEEK_SET) == -1) {
-		perror("lseek: ");
-		return NULL;
-	}
-
-	buf = malloc(len);
-	if(!buf)
-		return NULL;
-
-	if(read(fd, buf, len) == -1) {
-		perror("read: ");
-		free(buf);
-		return NULL;
-	}
-	*filelen = len;
-	return buf;
-}
-
-
-int seek_next_header(int fd)
-{
-	off_t pos;
-
-	pos = lseek(fd, 0, SEEK_CUR);
-	if(pos == -1) {
-		perror("lseek");
-		return -1;
-	}
-
-	pos = (pos + 3) & ~3;
-	if(lseek(fd, pos, SEEK_SET) == -1) {
-		perror("lseek");
-		return -1;
-	}
-	return 0;
-}
-
-
-int next_header_pos(int fd, struct cffs_hdr *header)
-{
-	off_t newpos = 0;
-
-	if(header->magic == CISCO_CLASSB)
-		newpos = sizeof(struct cb_hdr) + header->hdr.cbfh.length;
-	else
-		newpos = sizeof(struct ca_hdr) + header->hdr.cafh.length;
-
-	newpos += header->pos;
-	newpos = (newpos + 3) & ~3;
-	if(lseek(fd, newpos, SEEK_SET) == -1) {
-		perror("lseek: ");
-		return -1;
-	}
-	return 0;
-}
-		
-
-int read_header(int fd, struct cffs_hdr *header)
-{
-	char buf[sizeof(struct cffs_hdr)];
-
-	memset(buf, 0, sizeof(struct cffs_hdr));
-	header->pos = lseek(fd, 0, SEEK_CUR);
-	if(header->pos == -1)
-		return -1;
-
-	if(read(fd, &buf, sizeof(header->magic)) < sizeof(header->magic))
-		return -1;
-	
-	header->magic = ntohl(*(uint32_t *)buf);
-
-	if(header->magic == CISCO_CLASSB) {
-		int len = sizeof(struct cb_hdr) - sizeof(header->magic);
-		if(read(fd, buf+4, len) < len)
-			return -1;
-
-		header->hdr.cbfh.magic = header->magic;
-		header->hdr.cbfh.length = ntohl(*(uint32_t *)(buf+4));
-		header->hdr.cbfh.chksum = ntohs(*(uint16_t *)(buf+8));
-		header->hdr.cbfh.flags = ntohs(*(uint16_t *)(buf+10));
-		header->hdr.cbfh.date = ntohl(*(uint32_t *)(buf+12));
-		strncpy(header->hdr.cbfh.name, buf+16, 48);
-		header->hdr.cbfh.name[47] = '\0';
-		return 0;
-	} else if(header->magic == CISCO_CLASSA) {
-		int len = sizeof(struct ca_hdr) - sizeof(header->magic);
-		if(read(fd, buf+4, len) < len)
-			return -1;
-
-		header->hdr.cafh.magic = header->magic;
-		header->hdr.cafh.filenum = ntohl(*(uint32_t *)(buf+4));
-		strncpy(header->hdr.cbfh.name, buf+8, 64);
-		header->hdr.cbfh.name[63] = '\0';			
-		header->hdr.cafh.length = ntohl(*(uint32_t *)(buf+72));
-		header->hdr.cafh.seek = ntohl(*(uint32_t *)(buf+76));
-		header->hdr.cafh.crc = ntohl(*(uint32_t *)(buf+80));
-		header->hdr.cafh.type = ntohl(*(uint32_t *)(buf+84));
-		header->hdr.cafh.date = ntohl(*(uint32_t *)(buf+88));
-		header->hdr.cafh.unk = ntohl(*(uint32_t *)(buf+92));
-		header->hdr.cafh.flag1 = ntohl(*(uint32_t *)(buf+96));
-		header->hdr.cafh.flag2 = ntohl(*(uint32_t *)(buf+100));
-		return 0;
-	}
-	return -1;
-}
-
-
-int write_header(int fd, struct cffs_hdr *header)
-{
-	char buf[sizeof(struct cffs_hdr)];
-	int len = 0;
-
-	memset(buf, 0, sizeof(struct cffs_hdr));
-
-	if(header->magic == CISCO_CLASSB) {
-		len = sizeof(struct cb_hdr);
-		*(uint32_t *)(buf) = htonl(header->hdr.cbfh.magic);
-		*(uint32_t *)(buf+4) = htonl(header->hdr.cbfh.length);
-		*(uint16_t *)(buf+8) = htons(header->hdr.cbfh.chksum);
-		*(uint16_t *)(buf+10) = htons(header->hdr.cbfh.flags);
-		*(uint32_t *)(buf+12) = htonl(header->hdr.cbfh.date);
-		memcpy(buf+16, header->hdr.cbfh.name, 48);
-	} 
-	else if(header->magic == CISCO_CLASSA) {
-		len = sizeof(struct ca_hdr);
-		*(uint32_t *)(buf) = htonl(header->hdr.cafh.magic);
-		*(uint32_t *)(buf+4) = htonl(header->hdr.cafh.filenum);
-		memcpy(buf+8, header->hdr.cafh.name, 64);
-		*(uint32_t *)(buf+72) = htonl(header->hdr.cafh.length);
-		*(uint32_t *)(buf+76) = htonl(header->hdr.cafh.seek);
-		*(uint32_t *)(buf+80) = htonl(header->hdr.cafh.crc);
-		*(uint32_t *)(buf+84) = htonl(header->hdr.cafh.type);
-		*(uint32_t *)(buf+88) = htonl(header->hdr.cafh.date);
-		*(uint32_t *)(buf+92) = htonl(header->hdr.cafh.unk);
-		*(uint32_t *)(buf+96) = htonl(header->hdr.cafh.flag1);
-		*(uint32_t *)(buf+100) = htonl(header->hdr.cafh.flag2);
-		memset(buf+104, 0, sizeof(header->hdr.cafh.pad));
-	}
-	else return -1;
-		
-	if(lseek(fd, header->pos, SEEK_SET) == -1) {
-		perror("lseek: ");
-		return -1;
-	}
-	if(write(fd, &buf, len) != len) {
-		perror("write: ");
-		return -1;
-	}
-
-	return 0;
-}
-
-
-int put_file(int fd, char *fname, uint32_t magic)
-{
-	struct stat sinfo;
-	int fd2 = -1;
-	char *file = NULL;
-	struct cffs_hdr header;
-	char *basename;
-
-	header.magic = magic;
-	header.pos = lseek(fd, 0, SEEK_CUR);
-	if(header.pos == -1) {
-		perror("lseek: ");
-		return -1;
-	}
-
-	/* open the file */
-	fd2 = open(fname, O_RDONLY);
-	if(fd2 == -1) {
-		fprintf(stderr, "Cant open %s: %s\n", fname, strerror(errno));
-		return -1;
-	}
-
-	if(fstat(fd2, &sinfo) == -1) {
-		fprintf(stderr, "Cant stat %s: %s\n", fname, strerror(errno));
-		close(fd2);
-		return -1;
-	}
-
-	if(!S_ISREG(sinfo.st_mode)) {
-		fprintf(stderr, "Skipping %s, not a file\n", fname);
-		close(fd2);
-		return -1;
-	}
-
-	/* read it in */
-	file = malloc(sinfo.st_size);
-	if(!file) {
-		goto put_err;
-	}
-
-	if(read(fd2, file, sinfo.st_size) != sinfo.st_size) {
-		fprintf(stderr, "Cant read in all of file %s\n", fname);
-		goto put_err;
-	}
-	close(fd2);
-
-	basename = strrchr(fname, '/');
-	if(!basename)
-		basename = fname;
-	else
-		basename++;
-
-	if(magic == CISCO_CLASSB) {
-		time_t now;
-		header.hdr.cbfh.magic = magic;
-		header.hdr.cbfh.length = sinfo.st_size;
-		header.hdr.cbfh.chksum = calc_chk16(file, sinfo.st_size);
-		header.hdr.cbfh.flags = 0xFFFF & ~FLAG_HASDATE;
-		time(&now);
-		header.hdr.cbfh.date = now;
-		memset(header.hdr.cbfh.name, 0, 48);
-		strncpy(header.hdr.cbfh.name, basename, 48);
-		header.hdr.cbfh.name[47] = '\0';
-	} else {
-		time_t now;
-		time(&now);
-
-		header.hdr.cafh.magic = magic;
-		header.hdr.cafh.filenum = 1;
-		memset(header.hdr.cafh.name, 0, 64);
-		strncpy(header.hdr.cafh.name, basename, 64);
-		header.hdr.cbfh.name[63] = '\0';
-		header.hdr.cafh.length = sinfo.st_size;
-		header.hdr.cafh.seek = header.pos+sizeof(struct ca_hdr);
-		header.hdr.cafh.crc = 0;
-		header.hdr.cafh.type = 1;
-		header.hdr.cafh.date = now;
-		header.hdr.cafh.unk = 0;
-		header.hdr.cafh.flag1 = 0xfffffff8;
-		header.hdr.cafh.flag2 = 0xffffffff;
-	}
-	
-	if(write_header(fd, &header) == -1)
-		goto put_err;
-
-	if(write(fd, file, sinfo.st_size) != sinfo.st_size) {
-		perror("write: ");
-		goto put_err;
-	}
-
-	close(fd2);
-	return 0;
-
-
- put_err:
-	if(fd2 != -1)
-		close(fd2);
-	if(file)
-		free(file);
-	return -1;
-}
-
 
-int get_file(char *buf, int len, struct cffs_hdr *header)
+/* Save a file to the run's directory, checking its checksum on the way
+ * through if check is set. With more than one device existing files are
+ * only overwritten with --yes.
+ */
+int get_file(struct run *r, struct cffs_hdr *header, int check, int yes)
 {
-	char *name = header->magic == CISCO_CLASSB ? header->hdr.cbfh.name : header->hdr.cafh.name;
-	int fd;
+	char *name = header_name(header);
+	int fd, ret;
 	
 	/* note - racy */
-	if(!access(name, F_OK)) {
+	if(!yes && !faccessat(r->dirfd, name, F_OK, 0)) {
+		if(r->multi) {
+			fprintf(r->err, "File %s exists, skipped\n", name);
+			return 0;
+		}
 		printf("File %s exists, overwrite? [Y/n]", name);
 		fflush(stdout);
 		if(!confirm_action(NULL))
 			return 0;
 	}
-	fd = open(name, O_CREAT | O_TRUNC | O_RDWR, 0600);
+	fd = openat(r->dirfd, name, O_CREAT | O_TRUNC | O_RDWR, 0600);
 	if(fd == -1) {
-		fprintf(stderr, "Error opening %s for writing, %s\n", name, strerror(errno));
-		return -1;
-	}
-	if(write(fd, buf, len) == -1) {
-		fprintf(stderr, "Error writing to %s, %s\n", name, strerror(errno));
-		close(fd);
+		fprintf(r->err, "Error opening %s for writing, %s\n", name, strerror(errno));
 		return -1;
 	}
+	ret = cffs_copy(r->h, header, fd, check);
 	close(fd);
-	return 0;
-}
-
-
-int delete_file(int fd, struct cffs_hdr *header)
-{
-	uint16_t flag;
-	off_t pos;
-
-	if(header->magic == CISCO_CLASSB) {
-		if(!(header->hdr.cbfh.flags & FLAG_DELETED)) {
-			return 0;
-		}
-		header->hdr.cbfh.flags &= ~FLAG_DELETED;
-		flag = htons(header->hdr.cbfh.flags);
-		pos = header->pos + 10;
-	} else {
-		return -1;
-	}
-	if(lseek(fd, pos, SEEK_SET) == -1) {
-		perror("lseek: ");
-		return -1;
-	}
-	if(write(fd, &flag, sizeof(flag)) == -1) {
-		perror("write: ");
+	if(ret) {
+		fprintf(r->err, "%s\n", cffs_errmsg(r->h));
 		return -1;
 	}
-	
-	if(lseek(fd, header->pos, SEEK_SET) == -1) {
-		perror("lseek: ");
-		return -1;
-	}
-	if(read_header(fd, header) == -1) {
-		fprintf(stderr, "read_header failed\n");
-		return -1;
-	}
-
-	if(!(header->hdr.cbfh.flags & FLAG_DELETED))
-		return 0;
-	fprintf(stderr, "Failed to delete file %s\n", 
-		(header->magic == CISCO_CLASSB) ? header->hdr.cbfh.name
-		: header->hdr.cafh.name);
-	return -1;
+	return 0;
 }
 
 
-void dump_header(struct cffs_hdr *header, uint16_t chk)
+void dump_header(FILE *out, struct cffs_hdr *header, uint32_t chk)
 {
 	struct cb_hdr *h = &header->hdr.cbfh;
+	struct ca_hdr *ca = &header->hdr.cafh;
 	time_t t = (time_t)h->date;
 	struct tm tm;
 	char timebuf[16];
 
+	if(header->magic == CISCO_CLASSA) {
+		t = (time_t)ca->date;
+		localtime_r(&t, &tm);
+		strftime(timebuf, 15, "%b %d %H:%M", &tm);
+		fprintf(out, "%10d %s [%8.8X] [%8.8X] %s %s %s\n", ca->length, timebuf, ca->crc, ca->flag2,
+		       ca->name, (ca->flag2 == 0xfffeffff) ? "[deleted]" : "",
+		       (chk != ca->crc) ? "[bad crc]" : "");
+		return;
+	}
+
 	localtime_r(&t, &tm);
 
 	if(!(h->flags & FLAG_HASDATE))
@@ -475,7 +206,7 @@ void dump_header(struct cffs_hdr *header, uint16_t chk)
 	else
 		strcpy(timebuf, "  <no date> ");
 
-	printf("%10d %s [%4.4X] [%4.4X] %s %s %s\n", h->length, timebuf, h->chksum, h->flags, h->name,
+	fprintf(out, "%10d %s [%4.4X] [%4.4X] %s %s %s\n", h->length, timebuf, h->chksum, h->flags, h->name,
 	       !(h->flags & FLAG_DELETED) ? "[deleted]" : "",
 	       (chk != h->chksum) ? "[bad chksum]" : "");
 }
@@ -491,87 +222,71 @@ void dump_header_ext(struct ca_hdr *h)
 }
 
 
-int get_dev_info(int fd, struct mtd_info_user *mtd)
-{
-	if(ioctl(fd, MEMGETINFO, mtd) == -1) {
-		perror("ioctl: MEMGETINFO: ");
-		return -1;
-	}
-	return 0;
-}	
-
-
-int erase_device(int fd)
-{
-	int blocks, cnt;
-	struct erase_info_user erase;
-	struct mtd_info_user mtd;
-
-	if(get_dev_info(fd, &mtd) == -1)
-		return -1;
-
-	printf("Size = %u erase size = %u\n", mtd.size, mtd.erasesize);
-	if(!mtd.size)
-		return -1;
-
-	blocks =  mtd.size / mtd.erasesize;
-	printf("%d Erase blocks\n", blocks);
-	if(!confirm_action("erase"))
-		return -1;
-
-	erase.start = 0;
-	erase.length = mtd.erasesize;
-	for(cnt = 0; cnt < blocks; cnt++) {
-		printf("\rErasing block %6d/%d", cnt+1, blocks);
-		fflush(stdout);
-		if(ioctl(fd, MEMERASE, &erase) == -1) {
-			fprintf(stderr, "\nerase failed: %s\n", strerror(errno));
-			return -1;
-		} 
-		erase.start += mtd.erasesize;
-	}
-	printf("\n");
-	return 0;
-		
-}
-
-
 void usage()
 {
 	printf("cffs - cisco flash file system reader\n");
 	printf("Version " VERSION "  " COPYRIGHT"\n");
 	printf("Usage: cffs <device> <option> [files...]\n");
-	printf("\t<device>\tMTD Char device (eg /dev/mtd/0)\n");
+	printf("       cffs -D <device> [-D <device>...] <option> [files...]\n");
+	printf("\t<device>\tMTD Char device (eg /dev/mtd/0) or image file\n");
 	printf("\t-l, --dir\tList files\n");
+	printf("\t-L, --list\tList files from the headers only\n");
 	printf("\t-d, --delete\tDelete files\n");
 	printf("\t-e, --erase\tErase flash\n");
 	printf("\t-g, --get\tGet files from flash\n");
 	printf("\t-p, --put\tPut files onto flash\n");
 	printf("\t-f, --fsck\tCheck file system\n");
+	printf("\t-b, --batch F\tRun the commands in file F, - for stdin\n");
 	printf("\t-h, --help\tUsage information\n");
 	printf("\t-v, --version\tShow version\n");
+	printf("Modifiers:\n");
+	printf("\t-c, --check\tVerify checksums with --list and --get\n");
+	printf("\t-j, --jobs N\tThreads to use for --fsck, 0 for one per CPU\n");
+	printf("\t-i, --index F\tKeep a header index in file F\n");
+	printf("\t-q, --quick\tOnly erase blocks that are not already blank\n");
+	printf("\t-E, --emulate P:E[:S]\tTreat an image file as NOR flash taking P ns to\n"
+	       "\t\t\tprogram a byte and E us to erase a block of S bytes\n");
+	printf("\t-D, --device D\tAlso work on device D, may be given many times\n");
+	printf("\t-P, --parallel N\tWork on N devices at once, 0 for all of them\n");
+	printf("\t-y, --yes\tDont ask before erasing or overwriting files\n");
+	printf("\t-A, --class-a\tAllow putting files on Class A flash, the CRC is unverified\n");
 }
 
 
-enum options parse_opts(int argc, char **argv, char **device, int *filecnt, char ***files)
+enum options parse_opts(int argc, char **argv, char **device, int *filecnt, char ***files,
+			struct modifiers *mods)
 {
 	static struct option long_options[] = {
 		{"dir",		no_argument, NULL, 'l'},
+		{"list",	no_argument, NULL, 'L'},
 		{"delete",	no_argument, NULL, 'd'},
 		{"erase",	no_argument, NULL, 'e'},
 		{"get",		no_argument, NULL, 'g'},
 		{"put",		no_argument, NULL, 'p'},
 		{"fsck",	no_argument, NULL, 'f'},
+		{"batch",	required_argument, NULL, 'b'},
 		{"help",	no_argument, NULL, 'h'},
 		{"version",	no_argument, NULL, 'v'},
+		{"check",	no_argument, NULL, 'c'},
+		{"jobs",	required_argument, NULL, 'j'},
+		{"index",	required_argument, NULL, 'i'},
+		{"quick",	no_argument, NULL, 'q'},
+		{"emulate",	required_argument, NULL, 'E'},
+		{"device",	required_argument, NULL, 'D'},
+		{"parallel",	required_argument, NULL, 'P'},
+		{"yes",		no_argument, NULL, 'y'},
+		{"class-a",	no_argument, NULL, 'A'},
 		{0, 0, 0, 0}
 	};
-	static char *short_opts = "+ldegpfhv";
+	static char *short_opts = "+lLdegpfb:hvcj:i:qE:D:P:yA";
 	int a;
 	enum options option = none;
 
 	*files = NULL;
 	*filecnt = 0;
+	memset(mods, 0, sizeof(struct modifiers));
+	mods->jobs = 1;
+	mods->parallel = sysconf(_SC_NPROCESSORS_ONLN);
 	
 	if(argc > 1 && **(argv+1) != '-') {
 		*device = *(argv+1);
@@ -586,6 +301,59 @@ enum options parse_opts(int argc, char **argv, char **device, int *filecnt, char
 		if(a == -1)
 			break;
 
+		/* modifiers */
+		if(a == 'c') {
+			mods->check = 1;
+			continue;
+		}
+		if(a == 'j') {
+			mods->jobs = atoi(optarg);
+			if(mods->jobs <= 0)
+				mods->jobs = sysconf(_SC_NPROCESSORS_ONLN);
+			continue;
+		}
+		if(a == 'i') {
+			mods->index = optarg;
+			continue;
+		}
+		if(a == 'q') {
+			mods->quick = 1;
+			continue;
+		}
+		if(a == 'E') {
+			static struct nor_emul emul;
+
+			if(parse_emul(optarg, &emul) == -1) {
+				fprintf(stderr, "Error: --emulate takes PROG_NS:ERASE_US[:ERASESIZE]\n");
+				return bad_options;
+			}
+			mods->emul = &emul;
+			continue;
+		}
+		if(a == 'D') {
+			char **grown = realloc(mods->devices, (mods->devcnt + 1) * sizeof(char *));
+
+			if(!grown) {
+				perror("malloc: ");
+				return bad_options;
+			}
+			mods->devices = grown;
+			mods->devices[mods->devcnt++] = optarg;
+			continue;
+		}
+		if(a == 'P') {
+			mods->parallel = atoi(optarg);
+			continue;
+		}
+		if(a == 'y') {
+			mods->yes = 1;
+			continue;
+		}
+		if(a == 'A') {
+			mods->class_a = 1;
+			continue;
+		}
+
 		if(option != none) {
 			fprintf(stderr, "Error: only one option can be specified\n");
 			return bad_options;
@@ -596,6 +364,10 @@ enum options parse_opts(int argc, char **argv, char **device, int *filecnt, char
 			option = dir;
 			break;
 
+		case 'L':
+			option = list;
+			break;
+
 		case 'd':
 			option = delete;
 			break;
@@ -616,6 +388,11 @@ enum options parse_opts(int argc, char **argv, char **device, int *filecnt, char
 			option = fsck;
 			break;
 
+		case 'b':
+			option = batch;
+			mods->script = optarg;
+			break;
+
 		case 'h':
 			option = help;
 			break;
@@ -636,10 +413,19 @@ enum options parse_opts(int argc, char **argv, char **device, int *filecnt, char
 
 	/* check if a device is specified for the options that need it */
 
-	if(!*device && (option != help && option != version)) {
+	if(!*device && !mods->devcnt && (option != help && option != version)) {
 		fprintf(stderr, "Error: no device specified\n");
 		return bad_options;
 	}
+	if(mods->index && mods->devcnt + (*device != NULL) > 1) {
+		fprintf(stderr, "Error: --index can only be used with one device\n");
+		return bad_options;
+	}
+	if(option == batch && optind < argc) {
+		fprintf(stderr, "Error: files cant be given with --batch\n");
+		return bad_options;
+	}
+
 	/* check for any file names given */
 	if(optind < argc) {
 		*files = (argv+optind);
@@ -649,111 +435,550 @@ enum options parse_opts(int argc, char **argv, char **device, int *filecnt, char
 }		
 
 
-int fsck_device(int fd)
+/* Messages from the library, warnings go to the error output */
+void log_msg(void *arg, int level, const char *msg)
+{
+	struct run *r = arg;
+
+	fprintf(level == CFFS_LOG_INFO ? r->out : r->err, "%s\n", msg);
+}
+
+
+void show_progress(void *arg, enum cffs_progress what, long long done, long long total)
+{
+	struct run *r = arg;
+
+	/* Progress lines would only clutter the output of many devices */
+	if(r->multi && !(what == CFFS_PROG_BLANK && !done))
+		return;
+
+	switch(what) {
+	case CFFS_PROG_ERASE:
+		fprintf(r->out, "\rErasing block %6lld/%lld", done, total);
+		break;
+
+	case CFFS_PROG_ERASE_CHECK:
+		fprintf(r->out, "\rChecking block %6lld/%lld", done, total);
+		break;
+
+	case CFFS_PROG_BLANK:
+		if(!done)
+			fprintf(r->out, "Free space = %lld bytes\n", total);
+		else
+			fprintf(r->out, "\rChecking free space is blank: %d%% ",
+				(int)((100*done) / total));
+		break;
+	}
+	fflush(r->out);
+}
+
+
+void fsck_report(void *arg, struct cffs_hdr *header, uint32_t sum)
+{
+	struct run *r = arg;
+	int bad = sum != header_sum(header);
+
+	/* The Class A CRC has not been checked against a real card */
+	fprintf(r->out, "[CRC %s] %s %s\n", bad ? "BAD" : "OK ", header_name(header),
+		(bad && header->magic == CISCO_CLASSA) ? "(Class A CRC is unverified)" : "");
+}
+
+
+int fsck_device(struct run *r, int jobs)
 {
-	struct cffs_hdr header;
-	int eof = 0;
-	uint32_t def_magic = 0;
-	struct mtd_info_user mtd;
-	int to_check;
-	uint8_t *blank;
-	off_t curpos;
-	int free_spc, tested = 0, cnt;
-
-#define TEST_BUF_SZ (16<<10)
-
-	if(get_dev_info(fd, &mtd) == -1)
+	int ret;
+
+	ret = cffs_fsck(r->h, jobs, fsck_report, r, NULL);
+	if(ret == CFFS_ERR_CHKSUM) {
+		fprintf(r->out, "\n%s\n", cffs_errmsg(r->h));
+		return -1;
+	}
+	if(ret) {
+		fprintf(r->err, "\n%s\n", cffs_errmsg(r->h));
 		return -1;
+	}
+	fprintf(r->out, "\nFlash is OK\n");
+	return 0;
+}
 
-	while(!eof && read_header(fd, &header) != -1) {
-		int len;
-		char *buf;
 
-		if(header.magic == 0xffffffff) {
-			eof = 1;
-			continue;
-		}
-		if(!def_magic)
-			def_magic = header.magic;
+/* With more than one device the erase has already been confirmed */
+int erase_device(struct run *r, int quick, int yes)
+{
+	struct cffs_erase_stats stats;
+	off_t size = cffs_size(r->h);
+	uint32_t erasesize = cffs_erasesize(r->h);
+
+	fprintf(r->out, "Size = %lu erase size = %u\n", (unsigned long)size, erasesize);
+	if(!size)
+		return -1;
+
+	fprintf(r->out, "%d Erase blocks\n", (int)((size + erasesize - 1) / erasesize));
+	if(!r->multi && !yes && !confirm_action("erase"))
+		return -1;
+
+	if(cffs_erase(r->h, quick, &stats)) {
+		fprintf(r->err, "\n%s\n", cffs_errmsg(r->h));
+		return -1;
+	}
+	if(!r->multi)
+		fprintf(r->out, "\n");
+	if(quick)
+		fprintf(r->out, "Erased %d blocks in %d ranges, %d already blank\n", stats.erased,
+			stats.ranges, stats.blocks - stats.erased);
+	return 0;
+}
+
+
+/* List, get or delete a single file */
+int file_op(struct run *r, enum options option, struct modifiers *mods,
+	    struct cffs_hdr *header)
+{
+	uint32_t sum;
+
+	/* Fast listing only touches the headers */
+	if(option == list && !mods->check) {
+		dump_header(r->out, header, header_sum(header));
+	} else if(option == dir || option == list) {
+		if(cffs_sum(r->h, header, &sum))
+			goto error;
+		dump_header(r->out, header, sum);
+	} else if(option == get) {
+		return get_file(r, header, mods->check, mods->yes);
+	} else if(option == delete) {
+		fprintf(r->out, "deleting file %s\n", header_name(header));
+		if(cffs_delete(r->h, header))
+			goto error;
+	}
+	return 0;
+
+ error:
+	fprintf(r->err, "%s\n", cffs_errmsg(r->h));
+	return -1;
+}
+
+
+/* List, get or delete the files matching files */
+int match_files(struct run *r, enum options option, struct modifiers *mods, int filecnt,
+		char **files)
+{
+	struct cffs_hdr *hdrs;
+	int count, cnt;
+
+	if(cffs_scan(r->h)) {
+		fprintf(r->err, "%s\n", cffs_errmsg(r->h));
+		return -1;
+	}
+	hdrs = cffs_entries(r->h, &count);
 
-		buf = read_file(fd, &header, &len);
-		if(buf == NULL)
+	for(cnt = 0; cnt < count; cnt++) {
+		if(!file_match(filecnt, files, &hdrs[cnt]) &&
+		   file_op(r, option, mods, &hdrs[cnt]) == -1)
 			return -1;
+	}
+	return 0;
+}
+
+
+void free_batch(struct batch_cmd *cmds, int count)
+{
+	int cnt;
+
+	for(cnt = 0; cnt < count; cnt++) {
+		if(cmds[cnt].filecnt)
+			free(cmds[cnt].files[0]);
+		free(cmds[cnt].files);
+	}
+	free(cmds);
+}
 
-		switch(header.magic) {
-		case CISCO_CLASSB: {
-			uint16_t chk = calc_chk16(buf, len);
-			printf("[CRC %s] %s \n", (chk == header.hdr.cbfh.chksum) ? "OK " : "BAD",
-			       header.hdr.cbfh.name);
 
+/*
+ * Read a --batch command file. Each line is a command named after one of
+ * the long options, dir, list, get, delete or put, followed by its file
+ * names. Blank lines and lines starting with # are ignored. The names on
+ * a line are kept in one allocation starting at files[0].
+ */
+int read_batch(char *script, struct batch_cmd **cmdp, int *countp)
+{
+	static const struct {
+		char		*name;
+		enum options	option;
+	} names[] = {
+		{ "dir", dir }, { "list", list }, { "get", get }, { "delete", delete },
+		{ "put", put }
+	};
+	struct batch_cmd *cmds = NULL, *grown, *cmd;
+	FILE *fp;
+	char *line = NULL, *tok, *copy, *next;
+	size_t alloced = 0;
+	int count = 0, lineno = 0, cnt, ret = 0;
+
+	fp = strcmp(script, "-") ? fopen(script, "r") : stdin;
+	if(!fp) {
+		fprintf(stderr, "Cant open %s: %s\n", script, strerror(errno));
+		return -1;
+	}
+	while(!ret && getline(&line, &alloced, fp) != -1) {
+		lineno++;
+		tok = strtok(line, " \t\r\n");
+		if(!tok || *tok == '#')
+			continue;
+
+		grown = realloc(cmds, (count + 1) * sizeof(struct batch_cmd));
+		if(!grown) {
+			perror("malloc: ");
+			ret = -1;
 			break;
 		}
+		cmds = grown;
+		cmd = &cmds[count];
+		memset(cmd, 0, sizeof(struct batch_cmd));
+		for(cnt = 0; cnt < (int)(sizeof(names) / sizeof(names[0])); cnt++) {
+			if(!strcmp(tok, names[cnt].name))
+				cmd->option = names[cnt].option;
+		}
+		if(cmd->option == none) {
+			fprintf(stderr, "%s:%d: unknown command %s\n", script, lineno, tok);
+			ret = -1;
+			break;
+		}
+		count++;
+
+		/* Copy the rest of the line and point files into it */
+		tok = strtok(NULL, "\r\n");
+		if(!tok)
+			tok = "";
+		copy = strdup(tok);
+		cmd->files = malloc((strlen(tok) / 2 + 1) * sizeof(char *));
+		if(!copy || !cmd->files) {
+			perror("malloc: ");
+			free(copy);
+			ret = -1;
+			break;
+		}
+		for(next = strtok(copy, " \t"); next; next = strtok(NULL, " \t"))
+			cmd->files[cmd->filecnt++] = next;
+		if(!cmd->filecnt)
+			free(copy);
+		if(cmd->option == put && !cmd->filecnt) {
+			fprintf(stderr, "%s:%d: put needs files\n", script, lineno);
+			ret = -1;
+		}
+	}
+	free(line);
+	if(fp != stdin)
+		fclose(fp);
 
-		default:
-			fprintf(stderr, "Bad magic: 0x%8.8X\n", header.magic);
-			free(buf);
-			return -1;
+	if(ret) {
+		free_batch(cmds, count);
+		return -1;
+	}
+	*cmdp = cmds;
+	*countp = count;
+	return 0;
+}
+
+
+/*
+ * Run a batch of commands with a single scan of the header chain. The
+ * listings and gets are done first in one pass over the files in the order
+ * they are on the flash, then the deletes, and last all of the puts go on
+ * the end as one batch. Every command sees the files as they were before
+ * the batch started, whatever order the commands were given in.
+ */
+int run_batch(struct run *r, struct modifiers *mods, struct batch_cmd *cmds, int count)
+{
+	struct cffs_hdr *hdrs;
+	char **puts = NULL;
+	int hdrcnt, cnt, cmd, putcnt = 0, ret = 0;
+
+	if(cffs_scan(r->h)) {
+		fprintf(r->err, "%s\n", cffs_errmsg(r->h));
+		return -1;
+	}
+	hdrs = cffs_entries(r->h, &hdrcnt);
+
+	for(cnt = 0; cnt < hdrcnt && !ret; cnt++) {
+		for(cmd = 0; cmd < count && !ret; cmd++) {
+			if(cmds[cmd].option == delete || cmds[cmd].option == put)
+				continue;
+			if(!file_match(cmds[cmd].filecnt, cmds[cmd].files, &hdrs[cnt]))
+				ret = file_op(r, cmds[cmd].option, mods, &hdrs[cnt]);
+		}
+	}
+
+	/* Each file is deleted once however many commands match it */
+	for(cnt = 0; cnt < hdrcnt && !ret; cnt++) {
+		for(cmd = 0; cmd < count; cmd++) {
+			if(cmds[cmd].option == delete &&
+			   !file_match(cmds[cmd].filecnt, cmds[cmd].files, &hdrs[cnt])) {
+				ret = file_op(r, delete, mods, &hdrs[cnt]);
+				break;
+			}
 		}
-		
-		free(buf);
-		if(next_header_pos(fd, &header) == -1)
-			return -1;
 	}
-	curpos = lseek(fd, -4, SEEK_CUR);
-	if(curpos == -1) {
-		perror("lseek: ");
+	if(ret)
 		return -1;
+
+	for(cmd = 0; cmd < count; cmd++) {
+		if(cmds[cmd].option == put)
+			putcnt += cmds[cmd].filecnt;
 	}
-		
-	/* Now check the rest of the flash is blank */
-	free_spc = to_check = (mtd.size - curpos);
-	printf("Free space = %d bytes\n", free_spc);
-	blank = malloc(TEST_BUF_SZ);
-	if(!blank) {
+	if(!putcnt)
+		return 0;
+	puts = malloc(putcnt * sizeof(char *));
+	if(!puts) {
 		perror("malloc: ");
 		return -1;
 	}
-	while(to_check) {
-		int len = (to_check > TEST_BUF_SZ) ? TEST_BUF_SZ : to_check;
-		int red = read(fd, blank, len);
-		if(red != len) {
-			perror("read: ");
-			free(blank);
+	for(putcnt = 0, cmd = 0; cmd < count; cmd++) {
+		for(cnt = 0; cmds[cmd].option == put && cnt < cmds[cmd].filecnt; cnt++)
+			puts[putcnt++] = cmds[cmd].files[cnt];
+	}
+	if(cffs_put(r->h, puts, putcnt, 0)) {
+		fprintf(r->err, "%s\n", cffs_errmsg(r->h));
+		ret = -1;
+	}
+	free(puts);
+	return ret;
+}
+
+
+int run_device(struct run *r, struct job *job)
+{
+	struct modifiers *mods = job->mods;
+	struct nor_emul *emul = NULL;
+	int ret;
+
+	/* Each device gets its own emulator counts */
+	if(mods->emul) {
+		r->emul = *mods->emul;
+		emul = &r->emul;
+	}
+	ret = cffs_open(&r->h, r->device, job->rdwr, emul);
+	if(ret) {
+		fprintf(r->err, "%s\n", r->h ? cffs_errmsg(r->h) : cffs_strerror(ret));
+		cffs_close(r->h);
+		return -1;
+	}
+	cffs_set_callbacks(r->h, log_msg, show_progress, r);
+	if(mods->index)
+		cffs_set_index(r->h, mods->index);
+	cffs_set_class_a(r->h, mods->class_a);
+	
+	if(job->option == erase) {
+		ret = erase_device(r, mods->quick, mods->yes);
+	} else if(job->option == fsck) {
+		ret = fsck_device(r, mods->jobs);
+	} else if(job->option == batch) {
+		ret = run_batch(r, mods, job->cmds, job->count);
+	} else if(job->option == put) {
+		ret = cffs_put(r->h, job->files, job->filecnt, 0);
+		if(ret)
+			fprintf(r->err, "%s\n", cffs_errmsg(r->h));
+	} else {
+		ret = match_files(r, job->option, mods, job->filecnt, job->files);
+	}
+
+	if(cffs_sync(r->h))
+		fprintf(r->err, "%s\n", cffs_errmsg(r->h));
+	cffs_close(r->h);
+	r->h = NULL;
+
+	if(emul)
+		fprintf(r->err, "NOR emulator: %llu bytes programmed, %llu blocks erased, "
+			"%.3fs of program and erase time\n", (unsigned long long)emul->programmed,
+			(unsigned long long)emul->erased, emul->total_ns / 1e9);
+	return ret ? -1 : 0;
+}
+
+
+/*
+ * Multi device mode. Up to --parallel threads take the devices in turn and
+ * run the whole job on each, so the erases and reads of different cards
+ * overlap. Each device's output is printed in one piece, in the order the
+ * devices were given, followed by a summary.
+ */
+struct device_pool {
+	struct job	*job;
+	struct run	*runs;
+	int		count;
+	int		next;		/* next device to start */
+	pthread_mutex_t	lock;
+	pthread_cond_t	done;		/* a device was finished */
+};
+
+
+void *device_worker(void *arg)
+{
+	struct device_pool *pool = arg;
+	struct run *r;
+	int ret;
+
+	pthread_mutex_lock(&pool->lock);
+	while(pool->next < pool->count) {
+		r = &pool->runs[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		ret = run_device(r, pool->job);
+		fclose(r->out);
+
+		pthread_mutex_lock(&pool->lock);
+		r->ret = ret;
+		r->done = 1;
+		pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+
+/* Files got from many devices are saved in a directory per device, named
+ * after the last part of the device name with .d on the end.
+ */
+int open_get_dir(struct run *runs, int n)
+{
+	char *name = strrchr(runs[n].device, '/'), *dir;
+	int cnt, ret = 0;
+
+	name = name ? name + 1 : runs[n].device;
+	for(cnt = 0; cnt < n; cnt++) {
+		char *other = strrchr(runs[cnt].device, '/');
+
+		if(!strcmp(name, other ? other + 1 : runs[cnt].device)) {
+			fprintf(stderr, "Error: %s and %s would both save files in %s.d/\n",
+				runs[cnt].device, runs[n].device, name);
 			return -1;
 		}
-		for(cnt = 0; cnt < len; cnt++) {
-			if(blank[cnt] != 0xff) {
-				fprintf(stderr, "\nFlash is not blank\n");
-				free(blank);
-				return -1;
+	}
+	if(asprintf(&dir, "%s.d", name) == -1) {
+		perror("malloc: ");
+		return -1;
+	}
+	if(mkdir(dir, 0755) == -1 && errno != EEXIST) {
+		fprintf(stderr, "Cant create %s: %s\n", dir, strerror(errno));
+		ret = -1;
+	} else {
+		runs[n].dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+		if(runs[n].dirfd == -1) {
+			fprintf(stderr, "Cant open %s: %s\n", dir, strerror(errno));
+			ret = -1;
+		}
+	}
+	free(dir);
+	return ret;
+}
+
+
+int run_devices(char **devices, int count, struct job *job, int threads)
+{
+	struct device_pool pool;
+	struct run *runs;
+	pthread_t *tids;
+	int cnt, started, failed = 0, ret = 0;
+
+	runs = calloc(count, sizeof(struct run));
+	tids = calloc(count, sizeof(pthread_t));
+	if(!runs || !tids) {
+		perror("malloc: ");
+		free(runs);
+		free(tids);
+		return -1;
+	}
+	for(cnt = 0; cnt < count; cnt++) {
+		runs[cnt].device = devices[cnt];
+		runs[cnt].multi = 1;
+		runs[cnt].dirfd = -1;
+		if(job->gets && !ret && open_get_dir(runs, cnt) == -1)
+			ret = -1;
+	}
+	for(cnt = 0; cnt < count && !ret; cnt++) {
+		runs[cnt].out = runs[cnt].err = open_memstream(&runs[cnt].buf, &runs[cnt].len);
+		if(!runs[cnt].out) {
+			perror("open_memstream: ");
+			ret = -1;
+		}
+	}
+	if(ret) {
+		while(cnt--) {
+			if(runs[cnt].out) {
+				fclose(runs[cnt].out);
+				free(runs[cnt].buf);
 			}
 		}
-		tested += len;
-		to_check -= len;
-		printf("\rChecking free space is blank: %d%% ",
-		       (100*(free_spc-to_check)) /free_spc);
+		goto out;
 	}
-	printf("\nFlash is OK\n");
-	free(blank);
-	return 0;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.job = job;
+	pool.runs = runs;
+	pool.count = count;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.done, NULL);
+
+	if(threads <= 0 || threads > count)
+		threads = count;
+	for(started = 0; started < threads; started++) {
+		if(pthread_create(&tids[started], NULL, device_worker, &pool))
+			break;
+	}
+	if(!started)
+		device_worker(&pool);
+
+	pthread_mutex_lock(&pool.lock);
+	for(cnt = 0; cnt < count; cnt++) {
+		while(!runs[cnt].done)
+			pthread_cond_wait(&pool.done, &pool.lock);
+		printf("==> %s <==\n", runs[cnt].device);
+		fwrite(runs[cnt].buf, 1, runs[cnt].len, stdout);
+		if(runs[cnt].len && runs[cnt].buf[runs[cnt].len - 1] != '\n')
+			printf("\n");
+		printf("\n");
+		fflush(stdout);
+		free(runs[cnt].buf);
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	for(cnt = 0; cnt < started; cnt++)
+		pthread_join(tids[cnt], NULL);
+	pthread_cond_destroy(&pool.done);
+	pthread_mutex_destroy(&pool.lock);
+
+	printf("Summary:\n");
+	for(cnt = 0; cnt < count; cnt++) {
+		printf("  %-24s %s\n", runs[cnt].device, runs[cnt].ret ? "FAILED" : "OK");
+		if(runs[cnt].ret)
+			failed++;
+	}
+	printf("%d device(s), %d OK, %d failed\n", count, count - failed, failed);
+	if(failed)
+		ret = -1;
+
+ out:
+	for(cnt = 0; cnt < count; cnt++) {
+		if(runs[cnt].dirfd != -1)
+			close(runs[cnt].dirfd);
+	}
+	free(runs);
+	free(tids);
+	return ret;
 }
 
 
 int main(int argc, char **argv)
 {
 	char *device;
-	int fd = -1;
-	struct stat sinfo;
-	struct cffs_hdr header;
-	char *p;
-	int eof = 0;
 	enum options options;
+	struct modifiers mods;
+	struct job job;
+	struct run run;
 	int filecnt;
 	char **files;
-	uint32_t def_magic = 0;
-	int mode;
+	struct batch_cmd *cmds = NULL;
+	int count = 0, cnt, ret;
 			
-	options = parse_opts(argc, argv, &device, &filecnt, &files);
+	options = parse_opts(argc, argv, &device, &filecnt, &files, &mods);
 
 	if(options == bad_options)
 		exit(1);
@@ -777,96 +1002,58 @@ int main(int argc, char **argv)
 		break;
 
 	}
-		
-	/* Determine open mode */
-	if(options == put || options == delete || options == erase)
-		mode = O_RDWR;
-	else
-		mode = O_RDONLY;
-
-	fd = open(device, mode);
-	if(fd == -1) {
-		fprintf(stderr, "Cant open %s: %s\n", device, strerror(errno));
-		exit(1);
-	}
-	if(fstat(fd, &sinfo) == -1) {
-		fprintf(stderr, "Cant stat %s: %s\n", device, strerror(errno));
-		close(fd);
-		exit(1);
-	}
 
-	/* Check it is an MTD char device */
-	if(!S_ISCHR(sinfo.st_mode) || (MAJOR(sinfo.st_rdev) != MTD_CHAR_MAJOR)) {
-		fprintf(stderr, "%s is not an MTD character device\n", device);
-		close(fd);
-		exit(1);
-	}
-	
-	if(options == erase) {
-		erase_device(fd);
-	} else if(options == fsck) {
-		fsck_device(fd);
-	} else {
-		while(!eof && read_header(fd, &header) != -1) {
-			int len;
-			if(header.magic == 0xffffffff) {
-				printf("End of filesystem\n");
-				eof = 1;
-				continue;
-			}
-			if(!def_magic)
-				def_magic = header.magic;
-
-			if(!file_match(filecnt, files, &header)) {
-				if(options == dir || options == get) {
-					p = read_file(fd, &header, &len);
-					if(!p)
-						goto error;
-					if(options == dir) {
-						dump_header(&header, calc_chk16(p, len));
-					} else {
-						if(get_file(p, len, &header) == -1) {
-							free(p);
-							goto error;
-						}
-					}
-					free(p);
-				}
-				if(options == delete) {
-					printf("deleting file %s\n",header.hdr.cbfh.name );
-					if(delete_file(fd, &header) == -1) {
-						goto error;
-					}
-				}
-			}
-			if(next_header_pos(fd, &header) == -1)
-				goto error;
+	memset(&job, 0, sizeof(job));
+	job.option = options;
+	job.mods = &mods;
+	job.filecnt = filecnt;
+	job.files = files;
+	job.rdwr = options == put || options == delete || options == erase;
+	job.gets = options == get;
+	if(options == batch) {
+		if(read_batch(mods.script, &cmds, &count) == -1)
+			exit(1);
+		for(cnt = 0; cnt < count; cnt++) {
+			if(cmds[cnt].option == put || cmds[cnt].option == delete)
+				job.rdwr = 1;
+			if(cmds[cnt].option == get)
+				job.gets = 1;
 		}
+		job.cmds = cmds;
+		job.count = count;
 	}
 
-	
-	if(options == put) {
-		if(!def_magic)
-			def_magic = CISCO_CLASSB;
+	/* The device given first goes with any given with --device */
+	if(device && mods.devcnt) {
+		char **grown = realloc(mods.devices, (mods.devcnt + 1) * sizeof(char *));
 
-		if(lseek(fd, -4, SEEK_CUR) == -1) {
-			perror("lseek");
-			goto error;
-		}
-		while(filecnt--) {
-			printf("Adding file: %s\n", *(files));
-			put_file(fd, *(files++), def_magic);
-			if(seek_next_header(fd) == -1)
-				goto error;
+		if(!grown) {
+			perror("malloc: ");
+			exit(1);
 		}
+		memmove(grown + 1, grown, mods.devcnt * sizeof(char *));
+		grown[0] = device;
+		mods.devices = grown;
+		mods.devcnt++;
 	}
 
+	if(mods.devcnt > 1) {
+		if(options == erase && !mods.yes) {
+			printf("Erasing %d devices\n", mods.devcnt);
+			if(!confirm_action("erase"))
+				exit(1);
+		}
+		ret = run_devices(mods.devices, mods.devcnt, &job, mods.parallel);
+	} else {
+		memset(&run, 0, sizeof(run));
+		run.device = device ? device : mods.devices[0];
+		run.out = stdout;
+		run.err = stderr;
+		run.dirfd = AT_FDCWD;
+		ret = run_device(&run, &job);
+	}
 
-	close(fd);
-	exit(0);
-
- error:
-	if(fd != -1)
-		close(fd);
-	exit(1);
+	free_batch(cmds, count);
+	free(mods.devices);
+	exit(ret ? 1 : 0);
 }
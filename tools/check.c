@@ -0,0 +1,199 @@
+/*
+ * $Id$
+ *
+ * check.c - compare the fast versions of the cffs inner loops with the
+ * reference ones
+ *
+ * Copyright (C) 2002 Simon Evans (spse@secret.org.uk)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * Please see the file COPYING for more details
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "accel.h"
+
+
+/* Each case is a run of up to MAX_LEN bytes starting up to MAX_OFF bytes
+ * into an aligned buffer, so every alignment and every tail length of
+ * the wide versions gets used.
+ */
+#define MAX_OFF		64
+#define MAX_LEN		4097
+#define BUF_LEN		(MAX_OFF + MAX_LEN + MAX_OFF)
+
+static int failed;
+
+
+static void fail(const char *what, const char *name, size_t off, size_t len, uint32_t seed,
+		 size_t split, uint32_t got, uint32_t want)
+{
+	if(failed++ < 20)
+		fprintf(stderr, "%s %s: off %lu len %lu seed 0x%X split %lu gives 0x%X, "
+			"want 0x%X\n", what, name, (unsigned long)off, (unsigned long)len,
+			seed, (unsigned long)split, got, want);
+}
+
+
+/* The whole run in one call and in two, with a running sum passed on.
+ * Class B sums are only carried across even lengths, as the files are
+ * read in even sized chunks.
+ */
+static void check_chk16(const uint8_t *buf, size_t off, size_t len, uint16_t seed, size_t split)
+{
+	const uint8_t *p = buf + off;
+	uint16_t want, got;
+	int idx;
+
+	split &= ~(size_t)1;
+	want = chk16_update_ref(seed, p, len);
+	if(chk16_update_ref(chk16_update_ref(seed, p, split), p + split, len - split) != want)
+		fail("chk16", "ref split", off, len, seed, split, 0, want);
+
+	for(idx = 0; chk16_impls[idx].name; idx++) {
+		chk16_fn fn = chk16_impls[idx].fn;
+
+		if(!chk16_impls[idx].supported())
+			continue;
+		got = fn(seed, p, len);
+		if(got != want)
+			fail("chk16", chk16_impls[idx].name, off, len, seed, len, got, want);
+		got = fn(fn(seed, p, split), p + split, len - split);
+		if(got != want)
+			fail("chk16", chk16_impls[idx].name, off, len, seed, split, got, want);
+	}
+}
+
+
+static void check_crc32(const uint8_t *buf, size_t off, size_t len, uint32_t seed, size_t split)
+{
+	const uint8_t *p = buf + off;
+	uint32_t want, got;
+	int idx;
+
+	want = crc32_update_ref(seed, p, len);
+	for(idx = 0; crc32_impls[idx].name; idx++) {
+		crc32_fn fn = crc32_impls[idx].fn;
+
+		if(!crc32_impls[idx].supported())
+			continue;
+		got = fn(seed, p, len);
+		if(got != want)
+			fail("crc32", crc32_impls[idx].name, off, len, seed, len, got, want);
+		got = fn(fn(seed, p, split), p + split, len - split);
+		if(got != want)
+			fail("crc32", crc32_impls[idx].name, off, len, seed, split, got, want);
+	}
+}
+
+
+/* Blank run with one byte cleared at pos, or none if pos is len. The
+ * byte just past the end is never blank, it must not be seen.
+ */
+static void check_blank(uint8_t *buf, size_t off, size_t len, size_t pos)
+{
+	const uint8_t *p = buf + off;
+	size_t got;
+	int idx;
+
+	memset(buf, 0xff, BUF_LEN);
+	buf[off + len] = 0;
+	if(pos < len)
+		buf[off + pos] = rand() % 0xff;
+	if(off)
+		buf[off - 1] = 0;
+
+	if(find_nonblank_ref(p, len) != pos)
+		fail("blank", "ref", off, len, 0, pos, find_nonblank_ref(p, len), pos);
+	for(idx = 0; blank_impls[idx].name; idx++) {
+		if(!blank_impls[idx].supported())
+			continue;
+		got = blank_impls[idx].fn(p, len);
+		if(got != pos)
+			fail("blank", blank_impls[idx].name, off, len, 0, pos, got, pos);
+	}
+}
+
+
+static void usage(void)
+{
+	printf("Usage: cffs-check [-n CASES] [-s SEED]\n");
+	printf("\t-n CASES\tRandom cases to try, default 100000\n");
+	printf("\t-s SEED\t\tSeed for the cases, default 1\n");
+}
+
+
+int main(int argc, char **argv)
+{
+	uint8_t *buf, *blank;
+	long cases = 100000, cnt;
+	unsigned int seed = 1;
+	size_t off, len, split, idx;
+	int a;
+
+	while((a = getopt(argc, argv, "n:s:h")) != -1) {
+		switch(a) {
+		case 'n':
+			cases = atol(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			exit(a == 'h' ? 0 : 1);
+		}
+	}
+
+	buf = malloc(BUF_LEN);
+	blank = malloc(BUF_LEN);
+	if(!buf || !blank) {
+		perror("malloc: ");
+		exit(1);
+	}
+	srand(seed);
+	for(idx = 0; idx < BUF_LEN; idx++)
+		buf[idx] = rand();
+
+	/* Every short length at every offset, then random ones */
+	for(off = 0; off < MAX_OFF; off++) {
+		for(len = 0; len <= 130; len++) {
+			check_chk16(buf, off, len, 0, len / 2);
+			check_crc32(buf, off, len, 0, len / 2);
+			check_blank(blank, off, len, len);
+			if(len)
+				check_blank(blank, off, len, len - 1);
+		}
+	}
+	for(cnt = 0; cnt < cases; cnt++) {
+		off = rand() % MAX_OFF;
+		len = rand() % (MAX_LEN + 1);
+		split = len ? rand() % (len + 1) : 0;
+		/* Runs of 0xff words push the Class B sum to its edges */
+		if(cnt % 8 == 0)
+			memset(buf + off, 0xff, len);
+		check_chk16(buf, off, len, rand(), split);
+		check_crc32(buf, off, len, ((uint32_t)rand() << 16) ^ rand(), split);
+		check_blank(blank, off, len, rand() % (len + 1));
+		if(cnt % 8 == 0)
+			for(idx = off; idx < off + len; idx++)
+				buf[idx] = rand();
+	}
+
+	printf("%ld cases: chk16 %s, crc %s", cases, accel_impl_name(), crc32_impl_name());
+	printf(", %s\n", failed ? "FAILED" : "all versions agree");
+	free(buf);
+	free(blank);
+	return failed ? 1 : 0;
+}
@@ -5,6 +5,9 @@
  *
  */
 
+#ifndef CFFS_FILEHEADER_H
+#define CFFS_FILEHEADER_H
+
 /* Magic numbers */
 #define CISCO_CLASSA 0x07158805
 #define CISCO_CLASSB 0xBAD00B1E
@@ -54,4 +57,4 @@ struct cffs_hdr {
 	} hdr;
 };
 
-
+#endif
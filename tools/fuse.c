@@ -0,0 +1,608 @@
+/*
+ * $Id$
+ *
+ * fuse.c - read only FUSE file system for cisco flash cards and images
+ *
+ * Copyright (C) 2002 Simon Evans (spse@secret.org.uk)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * Please see the file COPYING for more details
+ *
+ */
+
+
+#define FUSE_USE_VERSION 31
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fuse.h>
+
+#include "libcffs.h"
+
+
+/*
+ * The header chain is scanned once at mount. Live files go in a table
+ * hashed on their names so a lookup does not walk the chain, and the
+ * file data is read through an LRU cache of CACHE_BLOCK sized pieces of
+ * the device.
+ */
+#define CACHE_BLOCK	(64<<10)
+
+struct entry {
+	struct cffs_hdr	*header;
+	char		*name;
+	off_t		pos;		/* device offset of the file body */
+	off_t		len;
+	time_t		date;
+};
+
+struct cache_block {
+	off_t		start;		/* device offset, -1 if unused */
+	uint8_t		*data;
+	struct cache_block *prev;	/* LRU list, most recently used first */
+	struct cache_block *next;
+	struct cache_block *hnext;	/* hash chain */
+};
+
+/* Per open file, for spotting sequential reads */
+struct open_file {
+	struct entry	*e;
+	off_t		next;		/* offset a sequential read would start at */
+	int		window;		/* blocks to read ahead */
+};
+
+struct cffs_fuse {
+	char		*device;
+	cffs_t		*h;
+	off_t		size;
+	off_t		free;
+	int		namemax;
+	struct entry	*entries;
+	int		count;
+	int		*table;		/* entry index + 1, 0 for empty */
+	unsigned	mask;
+
+	pthread_mutex_t	lock;		/* the cache and the handle */
+	struct cache_block *blocks;
+	int		nblocks;
+	struct cache_block **bhash;
+	unsigned	bmask;
+	struct cache_block *lru;	/* most recently used */
+	struct cache_block *lru_tail;
+	int		readahead;	/* largest read ahead window in blocks */
+	unsigned long	hits;
+	unsigned long	misses;
+};
+
+struct fuse_conf {
+	char		*device;
+	int		cache_mb;
+	int		readahead;
+};
+
+static struct cffs_fuse fs;
+
+
+static unsigned name_hash(const char *name)
+{
+	unsigned hash = 2166136261u;
+
+	while(*name) {
+		hash ^= (uint8_t)*name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+
+static int is_deleted(struct cffs_hdr *header)
+{
+	if(header->magic == CISCO_CLASSB)
+		return !(header->hdr.cbfh.flags & FLAG_DELETED);
+	return header->hdr.cafh.flag2 == 0xfffeffff;
+}
+
+
+static struct entry *find_entry(const char *path)
+{
+	unsigned slot;
+
+	if(*path == '/')
+		path++;
+	for(slot = name_hash(path) & fs.mask; fs.table[slot]; slot = (slot + 1) & fs.mask) {
+		struct entry *e = &fs.entries[fs.table[slot] - 1];
+
+		if(!strcmp(e->name, path))
+			return e;
+	}
+	return NULL;
+}
+
+
+/* Build the entry table from the scan. A name written more than once is
+ * the last live copy on the flash.
+ */
+static int build_index(void)
+{
+	struct cffs_hdr *hdrs;
+	struct entry *e;
+	off_t end;
+	int count, cnt;
+	unsigned size = 16;
+
+	hdrs = cffs_entries(fs.h, &count);
+	fs.entries = calloc(count ? count : 1, sizeof(struct entry));
+	while(size < 2 * (unsigned)count)
+		size <<= 1;
+	fs.table = calloc(size, sizeof(int));
+	if(!fs.entries || !fs.table)
+		return -1;
+	fs.mask = size - 1;
+	fs.namemax = (count && hdrs[0].magic == CISCO_CLASSA) ? 63 : 47;
+
+	for(cnt = 0; cnt < count; cnt++) {
+		struct cffs_hdr *header = &hdrs[cnt];
+
+		if(is_deleted(header) || !*header_name(header))
+			continue;
+		e = find_entry(header_name(header));
+		if(!e) {
+			unsigned slot = name_hash(header_name(header)) & fs.mask;
+
+			while(fs.table[slot])
+				slot = (slot + 1) & fs.mask;
+			e = &fs.entries[fs.count++];
+			fs.table[slot] = fs.count;
+		}
+		e->header = header;
+		e->name = header_name(header);
+		file_bounds(header, &e->pos, &end);
+		e->len = end - e->pos;
+		e->date = (header->magic == CISCO_CLASSB) ? header->hdr.cbfh.date
+			: header->hdr.cafh.date;
+	}
+	return 0;
+}
+
+
+static int cache_init(int cache_mb, int readahead)
+{
+	int cnt;
+
+	fs.nblocks = ((off_t)cache_mb << 20) / CACHE_BLOCK;
+	if(fs.nblocks < readahead + 1)
+		fs.nblocks = readahead + 1;
+	fs.readahead = readahead;
+	fs.blocks = calloc(fs.nblocks, sizeof(struct cache_block));
+	for(fs.bmask = 16; fs.bmask < 2 * (unsigned)fs.nblocks; fs.bmask <<= 1)
+		;
+	fs.bhash = calloc(fs.bmask--, sizeof(struct cache_block *));
+	if(!fs.blocks || !fs.bhash)
+		return -1;
+
+	for(cnt = 0; cnt < fs.nblocks; cnt++) {
+		struct cache_block *b = &fs.blocks[cnt];
+
+		b->start = -1;
+		b->data = malloc(CACHE_BLOCK);
+		if(!b->data)
+			return -1;
+		b->prev = cnt ? &fs.blocks[cnt-1] : NULL;
+		b->next = (cnt < fs.nblocks - 1) ? &fs.blocks[cnt+1] : NULL;
+	}
+	fs.lru = &fs.blocks[0];
+	fs.lru_tail = &fs.blocks[fs.nblocks-1];
+	pthread_mutex_init(&fs.lock, NULL);
+	return 0;
+}
+
+
+static unsigned block_slot(off_t start)
+{
+	return (unsigned)(start / CACHE_BLOCK) & fs.bmask;
+}
+
+
+static void lru_unlink(struct cache_block *b)
+{
+	if(b->prev)
+		b->prev->next = b->next;
+	else
+		fs.lru = b->next;
+	if(b->next)
+		b->next->prev = b->prev;
+	else
+		fs.lru_tail = b->prev;
+}
+
+
+static void lru_touch(struct cache_block *b)
+{
+	if(fs.lru == b)
+		return;
+	lru_unlink(b);
+	b->prev = NULL;
+	b->next = fs.lru;
+	fs.lru->prev = b;
+	fs.lru = b;
+}
+
+
+static struct cache_block *cache_find(off_t start)
+{
+	struct cache_block *b;
+
+	for(b = fs.bhash[block_slot(start)]; b; b = b->hnext) {
+		if(b->start == start)
+			return b;
+	}
+	return NULL;
+}
+
+
+/* Take the least recently used block for start */
+static struct cache_block *cache_evict(off_t start)
+{
+	struct cache_block *b = fs.lru_tail, **pp;
+
+	if(b->start != -1) {
+		for(pp = &fs.bhash[block_slot(b->start)]; *pp != b; pp = &(*pp)->hnext)
+			;
+		*pp = b->hnext;
+	}
+	b->start = start;
+	b->hnext = fs.bhash[block_slot(start)];
+	fs.bhash[block_slot(start)] = b;
+	lru_touch(b);
+	return b;
+}
+
+
+static void cache_drop(struct cache_block *b)
+{
+	struct cache_block **pp;
+
+	for(pp = &fs.bhash[block_slot(b->start)]; *pp != b; pp = &(*pp)->hnext)
+		;
+	*pp = b->hnext;
+	b->start = -1;
+	lru_unlink(b);
+	b->prev = fs.lru_tail;
+	b->next = NULL;
+	fs.lru_tail->next = b;
+	fs.lru_tail = b;
+}
+
+
+/* Fill count blocks from start with one device read. The blocks that are
+ * already cached are read again, which is cheaper than splitting the read.
+ */
+static int cache_fill(off_t start, int count)
+{
+	struct cache_block *b[count];
+	uint8_t *buf;
+	size_t len = (size_t)count * CACHE_BLOCK;
+	int cnt, ret;
+
+	if(start + (off_t)len > fs.size)
+		len = fs.size - start;
+	if(count == 1) {
+		b[0] = cache_find(start);
+		if(!b[0])
+			b[0] = cache_evict(start);
+		ret = cffs_pread(fs.h, start, b[0]->data, len);
+		if(ret)
+			cache_drop(b[0]);
+		return ret;
+	}
+
+	buf = malloc(len);
+	if(!buf)
+		return CFFS_ERR_NOMEM;
+	ret = cffs_pread(fs.h, start, buf, len);
+	for(cnt = 0; !ret && cnt < count && (size_t)cnt * CACHE_BLOCK < len; cnt++) {
+		off_t bstart = start + (off_t)cnt * CACHE_BLOCK;
+		size_t part = len - (size_t)cnt * CACHE_BLOCK;
+
+		b[cnt] = cache_find(bstart);
+		if(!b[cnt])
+			b[cnt] = cache_evict(bstart);
+		memcpy(b[cnt]->data, buf + (size_t)cnt * CACHE_BLOCK,
+		       part > CACHE_BLOCK ? CACHE_BLOCK : part);
+	}
+	free(buf);
+	return ret;
+}
+
+
+/* Copy len bytes of the device at pos into buf. A miss on a sequential
+ * stream reads the window of blocks ahead with it, and the window doubles
+ * each time up to the readahead limit.
+ */
+static int cache_read(struct open_file *of, off_t pos, uint8_t *buf, size_t len, off_t end)
+{
+	struct cache_block *b;
+	off_t start, last = (end + CACHE_BLOCK - 1) / CACHE_BLOCK;
+	size_t off, part;
+	int count, ret;
+
+	while(len) {
+		start = pos - pos % CACHE_BLOCK;
+		b = cache_find(start);
+		if(b) {
+			fs.hits++;
+			lru_touch(b);
+		} else {
+			fs.misses++;
+			count = 1;
+			if(of->window) {
+				count = of->window;
+				of->window *= 2;
+				if(of->window > fs.readahead)
+					of->window = fs.readahead;
+			}
+			if(start / CACHE_BLOCK + count > last)
+				count = last - start / CACHE_BLOCK;
+			if(count < 1)
+				count = 1;
+			ret = cache_fill(start, count);
+			if(ret)
+				return ret;
+			b = cache_find(start);
+		}
+		off = pos - start;
+		part = CACHE_BLOCK - off;
+		if(part > len)
+			part = len;
+		memcpy(buf, b->data + off, part);
+		buf += part;
+		pos += part;
+		len -= part;
+	}
+	return 0;
+}
+
+
+static void fill_stat(struct entry *e, struct stat *st)
+{
+	memset(st, 0, sizeof(struct stat));
+	st->st_mode = S_IFREG | 0444;
+	st->st_nlink = 1;
+	st->st_ino = e - fs.entries + 2;
+	st->st_size = e->len;
+	st->st_blocks = (e->len + 511) / 512;
+	st->st_mtime = st->st_ctime = st->st_atime = e->date;
+}
+
+
+static void *cf_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	/* Nothing can change the files under us */
+	cfg->kernel_cache = 1;
+	cfg->use_ino = 1;
+	return NULL;
+}
+
+
+static void cf_destroy(void *data)
+{
+	fprintf(stderr, "cffs-fuse: cache %lu hits, %lu misses\n", fs.hits, fs.misses);
+	cffs_close(fs.h);
+}
+
+
+static int cf_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+	struct entry *e;
+
+	if(!strcmp(path, "/")) {
+		memset(st, 0, sizeof(struct stat));
+		st->st_mode = S_IFDIR | 0555;
+		st->st_nlink = 2;
+		st->st_ino = 1;
+		return 0;
+	}
+	e = find_entry(path);
+	if(!e)
+		return -ENOENT;
+	fill_stat(e, st);
+	return 0;
+}
+
+
+static int cf_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off,
+		      struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+	struct stat st;
+	int cnt;
+
+	if(strcmp(path, "/"))
+		return -ENOTDIR;
+	filler(buf, ".", NULL, 0, 0);
+	filler(buf, "..", NULL, 0, 0);
+	for(cnt = 0; cnt < fs.count; cnt++) {
+		fill_stat(&fs.entries[cnt], &st);
+		if(filler(buf, fs.entries[cnt].name, &st, 0, 0))
+			break;
+	}
+	return 0;
+}
+
+
+static int cf_open(const char *path, struct fuse_file_info *fi)
+{
+	struct open_file *of;
+	struct entry *e;
+
+	e = find_entry(path);
+	if(!e)
+		return -ENOENT;
+	if((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EROFS;
+	of = calloc(1, sizeof(struct open_file));
+	if(!of)
+		return -ENOMEM;
+	of->e = e;
+	fi->fh = (uintptr_t)of;
+	fi->keep_cache = 1;
+	return 0;
+}
+
+
+static int cf_read(const char *path, char *buf, size_t size, off_t off,
+		   struct fuse_file_info *fi)
+{
+	struct open_file *of = (struct open_file *)(uintptr_t)fi->fh;
+	struct entry *e = of->e;
+	int ret;
+
+	if(off >= e->len)
+		return 0;
+	if((off_t)size > e->len - off)
+		size = e->len - off;
+
+	pthread_mutex_lock(&fs.lock);
+	if(off == of->next && off) {
+		if(!of->window)
+			of->window = (fs.readahead < 2) ? fs.readahead : 2;
+	} else {
+		of->window = 0;
+	}
+	ret = cache_read(of, e->pos + off, (uint8_t *)buf, size, e->pos + e->len);
+	of->next = off + size;
+	pthread_mutex_unlock(&fs.lock);
+
+	if(ret) {
+		fprintf(stderr, "cffs-fuse: %s\n", cffs_errmsg(fs.h));
+		return -EIO;
+	}
+	return size;
+}
+
+
+static int cf_release(const char *path, struct fuse_file_info *fi)
+{
+	free((void *)(uintptr_t)fi->fh);
+	return 0;
+}
+
+
+static int cf_statfs(const char *path, struct statvfs *st)
+{
+	memset(st, 0, sizeof(struct statvfs));
+	st->f_bsize = 512;
+	st->f_frsize = 512;
+	st->f_blocks = fs.size / 512;
+	st->f_bfree = st->f_bavail = fs.free / 512;
+	st->f_files = fs.count;
+	st->f_namemax = fs.namemax;
+	st->f_flag = ST_RDONLY;
+	return 0;
+}
+
+
+static const struct fuse_operations cf_ops = {
+	.init		= cf_init,
+	.destroy	= cf_destroy,
+	.getattr	= cf_getattr,
+	.readdir	= cf_readdir,
+	.open		= cf_open,
+	.read		= cf_read,
+	.release	= cf_release,
+	.statfs		= cf_statfs,
+};
+
+
+#define CONF_OPT(t, p) { t, offsetof(struct fuse_conf, p), 1 }
+
+static const struct fuse_opt conf_opts[] = {
+	CONF_OPT("cache=%d", cache_mb),
+	CONF_OPT("readahead=%d", readahead),
+	FUSE_OPT_END
+};
+
+
+static int conf_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+	struct fuse_conf *conf = data;
+
+	/* The first argument that is not an option is the device */
+	if(key == FUSE_OPT_KEY_NONOPT && !conf->device) {
+		conf->device = strdup(arg);
+		return 0;
+	}
+	return 1;
+}
+
+
+static void usage(void)
+{
+	printf("Usage: cffs-fuse [options] DEVICE MOUNTPOINT\n");
+	printf("\t-o cache=MB\tSize of the block cache, default 16\n");
+	printf("\t-o readahead=N\tRead up to N %dk blocks ahead, default 16\n",
+	       CACHE_BLOCK >> 10);
+	printf("Plus the usual FUSE options, the file system is always read only\n");
+}
+
+
+int main(int argc, char **argv)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_conf conf;
+	int ret;
+
+	memset(&conf, 0, sizeof(conf));
+	conf.cache_mb = 16;
+	conf.readahead = 16;
+	if(fuse_opt_parse(&args, &conf, conf_opts, conf_proc) == -1)
+		exit(1);
+	if(!conf.device) {
+		usage();
+		exit(1);
+	}
+	if(conf.cache_mb < 1 || conf.readahead < 1) {
+		fprintf(stderr, "cache and readahead must be at least 1\n");
+		exit(1);
+	}
+
+	/* Scan before mounting so errors are seen before fuse goes into the
+	 * background.
+	 */
+	memset(&fs, 0, sizeof(fs));
+	fs.device = conf.device;
+	ret = cffs_open(&fs.h, fs.device, 0, NULL);
+	if(!ret)
+		ret = cffs_scan(fs.h);
+	if(ret) {
+		fprintf(stderr, "%s\n", fs.h ? cffs_errmsg(fs.h) : cffs_strerror(ret));
+		cffs_close(fs.h);
+		exit(1);
+	}
+	fs.size = cffs_size(fs.h);
+	fs.free = cffs_free_space(fs.h);
+	if(build_index() == -1 || cache_init(conf.cache_mb, conf.readahead) == -1) {
+		perror("malloc: ");
+		cffs_close(fs.h);
+		exit(1);
+	}
+
+	fuse_opt_add_arg(&args, "-oro");
+	fuse_opt_add_arg(&args, "-ofsname=cffs");
+	ret = fuse_main(args.argc, args.argv, &cf_ops, NULL);
+	fuse_opt_free_args(&args);
+	return ret;
+}
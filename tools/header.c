@@ -0,0 +1,210 @@
+/*
+ * $Id$
+ *
+ * header.c - encode and decode Cisco flash file headers
+ *
+ * Copyright (C) 2002 Simon Evans (spse@secret.org.uk)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * Please see the file COPYING for more details
+ *
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "fileheader.h"
+#include "header.h"
+#include "accel.h"
+
+
+/*
+ * File checksums. Class B uses the 16 bit sum in chksum, Class A a CRC-32
+ * in crc. The Class A crc is taken to be the standard CRC-32 (as zlib and
+ * Ethernet) of the file body, stored big endian like the other fields.
+ */
+uint32_t file_sum(uint32_t magic, uint32_t sum, const uint8_t *buf, size_t len)
+{
+	if(magic == CISCO_CLASSB)
+		return chk16_update(sum, buf, len);
+	return crc32_update(sum, buf, len);
+}
+
+
+uint32_t header_sum(struct cffs_hdr *header)
+{
+	if(header->magic == CISCO_CLASSB)
+		return header->hdr.cbfh.chksum;
+	return header->hdr.cafh.crc;
+}
+
+
+char *header_name(struct cffs_hdr *header)
+{
+	if(header->magic == CISCO_CLASSB)
+		return header->hdr.cbfh.name;
+	return header->hdr.cafh.name;
+}
+
+
+/* Where the body of a file starts and ends */
+void file_bounds(struct cffs_hdr *header, off_t *pos, off_t *end)
+{
+	if(header->magic == CISCO_CLASSB) {
+		*pos = header->pos + sizeof(struct cb_hdr);
+		*end = *pos + header->hdr.cbfh.length;
+	} else {
+		*pos = header->pos + sizeof(struct ca_hdr);
+		*end = *pos + header->hdr.cafh.length;
+	}
+}
+
+
+/* Headers are on 4 byte boundaries */
+off_t next_header_pos(struct cffs_hdr *header)
+{
+	off_t newpos = 0;
+
+	if(header->magic == CISCO_CLASSB)
+		newpos = sizeof(struct cb_hdr) + header->hdr.cbfh.length;
+	else
+		newpos = sizeof(struct ca_hdr) + header->hdr.cafh.length;
+
+	newpos += header->pos;
+	return (newpos + 3) & ~3;
+}
+		
+
+/* Decode the header at buf, avail bytes of which are valid. Returns -1
+ * for a bad magic and -2 if the header is longer than avail.
+ */
+int decode_header(const uint8_t *buf, size_t avail, off_t pos, struct cffs_hdr *header)
+{
+	header->pos = pos;
+	if(avail < sizeof(header->magic))
+		return -2;
+
+	header->magic = ntohl(*(uint32_t *)buf);
+
+	if(header->magic == CISCO_CLASSB) {
+		if(avail < sizeof(struct cb_hdr))
+			return -2;
+
+		header->hdr.cbfh.magic = header->magic;
+		header->hdr.cbfh.length = ntohl(*(uint32_t *)(buf+4));
+		header->hdr.cbfh.chksum = ntohs(*(uint16_t *)(buf+8));
+		header->hdr.cbfh.flags = ntohs(*(uint16_t *)(buf+10));
+		header->hdr.cbfh.date = ntohl(*(uint32_t *)(buf+12));
+		strncpy(header->hdr.cbfh.name, (char *)buf+16, 48);
+		header->hdr.cbfh.name[47] = '\0';
+		return 0;
+	} else if(header->magic == CISCO_CLASSA) {
+		if(avail < sizeof(struct ca_hdr))
+			return -2;
+
+		header->hdr.cafh.magic = header->magic;
+		header->hdr.cafh.filenum = ntohl(*(uint32_t *)(buf+4));
+		strncpy(header->hdr.cafh.name, (char *)buf+8, 64);
+		header->hdr.cafh.name[63] = '\0';
+		header->hdr.cafh.length = ntohl(*(uint32_t *)(buf+72));
+		header->hdr.cafh.seek = ntohl(*(uint32_t *)(buf+76));
+		header->hdr.cafh.crc = ntohl(*(uint32_t *)(buf+80));
+		header->hdr.cafh.type = ntohl(*(uint32_t *)(buf+84));
+		header->hdr.cafh.date = ntohl(*(uint32_t *)(buf+88));
+		header->hdr.cafh.unk = ntohl(*(uint32_t *)(buf+92));
+		header->hdr.cafh.flag1 = ntohl(*(uint32_t *)(buf+96));
+		header->hdr.cafh.flag2 = ntohl(*(uint32_t *)(buf+100));
+		return 0;
+	}
+	return -1;
+}
+
+
+/* Encode a header into its on-flash form, returns its length or -1 */
+int encode_header(struct cffs_hdr *header, uint8_t *buf)
+{
+	int len = 0;
+
+	memset(buf, 0, sizeof(struct ca_hdr));
+
+	if(header->magic == CISCO_CLASSB) {
+		len = sizeof(struct cb_hdr);
+		*(uint32_t *)(buf) = htonl(header->hdr.cbfh.magic);
+		*(uint32_t *)(buf+4) = htonl(header->hdr.cbfh.length);
+		*(uint16_t *)(buf+8) = htons(header->hdr.cbfh.chksum);
+		*(uint16_t *)(buf+10) = htons(header->hdr.cbfh.flags);
+		*(uint32_t *)(buf+12) = htonl(header->hdr.cbfh.date);
+		memcpy(buf+16, header->hdr.cbfh.name, 48);
+	} 
+	else if(header->magic == CISCO_CLASSA) {
+		len = sizeof(struct ca_hdr);
+		*(uint32_t *)(buf) = htonl(header->hdr.cafh.magic);
+		*(uint32_t *)(buf+4) = htonl(header->hdr.cafh.filenum);
+		memcpy(buf+8, header->hdr.cafh.name, 64);
+		*(uint32_t *)(buf+72) = htonl(header->hdr.cafh.length);
+		*(uint32_t *)(buf+76) = htonl(header->hdr.cafh.seek);
+		*(uint32_t *)(buf+80) = htonl(header->hdr.cafh.crc);
+		*(uint32_t *)(buf+84) = htonl(header->hdr.cafh.type);
+		*(uint32_t *)(buf+88) = htonl(header->hdr.cafh.date);
+		*(uint32_t *)(buf+92) = htonl(header->hdr.cafh.unk);
+		*(uint32_t *)(buf+96) = htonl(header->hdr.cafh.flag1);
+		*(uint32_t *)(buf+100) = htonl(header->hdr.cafh.flag2);
+		memset(buf+104, 0, sizeof(header->hdr.cafh.pad));
+	}
+	else return -1;
+
+	return len;
+}
+
+
+/* Fill in a new header for fname, the checksum is filled in later */
+void make_header(struct cffs_hdr *header, uint32_t magic, off_t pos, char *fname,
+		 off_t size)
+{
+	char *basename;
+	time_t now;
+
+	header->magic = magic;
+	header->pos = pos;
+
+	basename = strrchr(fname, '/');
+	if(!basename)
+		basename = fname;
+	else
+		basename++;
+
+	time(&now);
+	if(magic == CISCO_CLASSB) {
+		header->hdr.cbfh.magic = magic;
+		header->hdr.cbfh.length = size;
+		header->hdr.cbfh.chksum = 0;
+		header->hdr.cbfh.flags = 0xFFFF & ~FLAG_HASDATE;
+		header->hdr.cbfh.date = now;
+		memset(header->hdr.cbfh.name, 0, 48);
+		strncpy(header->hdr.cbfh.name, basename, 48);
+		header->hdr.cbfh.name[47] = '\0';
+	} else {
+		header->hdr.cafh.magic = magic;
+		header->hdr.cafh.filenum = 1;
+		memset(header->hdr.cafh.name, 0, 64);
+		strncpy(header->hdr.cafh.name, basename, 64);
+		header->hdr.cafh.name[63] = '\0';
+		header->hdr.cafh.length = size;
+		header->hdr.cafh.seek = pos+sizeof(struct ca_hdr);
+		header->hdr.cafh.crc = 0;
+		header->hdr.cafh.type = 1;
+		header->hdr.cafh.date = now;
+		header->hdr.cafh.unk = 0;
+		header->hdr.cafh.flag1 = 0xfffffff8;
+		header->hdr.cafh.flag2 = 0xffffffff;
+	}
+}
@@ -0,0 +1,37 @@
+/*
+ * $Id$
+ *
+ * Encoding and decoding of the on-flash file headers
+ *
+ */
+
+#ifndef CFFS_HEADER_H
+#define CFFS_HEADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct cffs_hdr;
+
+/* Checksum a piece of a file of type magic, starting from a sum of 0 */
+uint32_t file_sum(uint32_t magic, uint32_t sum, const uint8_t *buf, size_t len);
+uint32_t header_sum(struct cffs_hdr *header);
+char *header_name(struct cffs_hdr *header);
+
+/* Where the body of a file starts and ends */
+void file_bounds(struct cffs_hdr *header, off_t *pos, off_t *end);
+
+/* Offset of the header after this one */
+off_t next_header_pos(struct cffs_hdr *header);
+
+/* Returns -1 for a bad magic and -2 if the header is longer than avail */
+int decode_header(const uint8_t *buf, size_t avail, off_t pos, struct cffs_hdr *header);
+
+/* buf must hold a struct ca_hdr, returns the encoded length or -1 */
+int encode_header(struct cffs_hdr *header, uint8_t *buf);
+
+void make_header(struct cffs_hdr *header, uint32_t magic, off_t pos, char *fname,
+		 off_t size);
+
+#endif
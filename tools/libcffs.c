@@ -0,0 +1,1737 @@
+/*
+ * $Id$
+ *
+ * libcffs.c - cisco flash filesystem access, shared by cffs and other
+ * programs that want to keep a card open
+ *
+ * Copyright (C) 2002 Simon Evans (spse@secret.org.uk)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * Please see the file COPYING for more details
+ *
+ */
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+
+#include "libcffs.h"
+#include "header.h"
+#include "accel.h"
+
+
+/* Chunk size for streaming file bodies, must be even */
+#define STREAM_BUF_SZ (64<<10)
+
+struct cffs {
+	struct cffs_dev	dev;
+	int		rdwr;
+	struct cffs_hdr	*hdrs;		/* the header chain */
+	int		count;
+	off_t		tail;		/* offset of the free space */
+	int		scanned;	/* hdrs, count and tail are valid */
+	char		*index;		/* sidecar index file or NULL */
+	int		dirty;		/* index needs writing */
+	int		class_a;	/* Class A files may be put */
+	cffs_log_fn	log;
+	cffs_progress_fn progress;
+	void		*cb_arg;
+	char		errmsg[256];
+};
+
+
+/* Record the details of an error and return its code */
+static int set_err(cffs_t *h, int err, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(h->errmsg, sizeof(h->errmsg), fmt, ap);
+	va_end(ap);
+	return err;
+}
+
+
+/* Error from reading or copying a file body, called while errno is still
+ * set from the failure.
+ */
+static int file_err(cffs_t *h, int err, struct cffs_hdr *header)
+{
+	switch(err) {
+	case CFFS_ERR_RANGE:
+		return set_err(h, err, "%s extends past end of flash", header_name(header));
+	case CFFS_ERR_NOMEM:
+		return set_err(h, err, "Out of memory");
+	case CFFS_ERR_OUTPUT:
+		return set_err(h, err, "Error writing %s: %s", header_name(header),
+			       strerror(errno));
+	}
+	if(h->dev.emul && *h->dev.emul->fault)
+		return set_err(h, CFFS_ERR_IO, "%s", h->dev.emul->fault);
+	return set_err(h, CFFS_ERR_IO, "Cant read %s: %s", header_name(header), strerror(errno));
+}
+
+
+/* Error from writing or erasing the device */
+static int io_err(cffs_t *h, const char *what)
+{
+	if(h->dev.emul && *h->dev.emul->fault)
+		return set_err(h, CFFS_ERR_IO, "%s", h->dev.emul->fault);
+	return set_err(h, CFFS_ERR_IO, "%s failed: %s", what, strerror(errno));
+}
+
+
+static void log_msg(cffs_t *h, int level, const char *fmt, ...)
+{
+	char msg[512];
+	va_list ap;
+
+	if(!h->log)
+		return;
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	h->log(h->cb_arg, level, msg);
+}
+
+
+static void progress(cffs_t *h, enum cffs_progress what, long long done, long long total)
+{
+	if(h->progress)
+		h->progress(h->cb_arg, what, done, total);
+}
+
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t wrote;
+
+	while(len) {
+		wrote = write(fd, buf, len);
+		if(wrote == -1 && errno == EINTR)
+			continue;
+		if(wrote <= 0)
+			return -1;
+		buf = (const char *)buf + wrote;
+		len -= wrote;
+	}
+	return 0;
+}
+
+
+/* Stream a file body through a fixed size buffer (or straight from the
+ * mapping), writing it to outfd if it is not -1 and checksumming it as a
+ * file of type magic if sum is not NULL. Returns CFFS_ERR_IO if the device
+ * cant be read and CFFS_ERR_OUTPUT if outfd cant be written.
+ */
+static int stream_range(struct cffs_dev *dev, off_t pos, off_t end, uint8_t *iobuf,
+		 int outfd, uint32_t magic, uint32_t *sum)
+{
+	uint8_t *buf;
+	int len;
+
+	if(sum)
+		*sum = 0;
+
+	while(pos < end) {
+		len = (end - pos > STREAM_BUF_SZ) ? STREAM_BUF_SZ : end - pos;
+		if(dev->map) {
+			buf = dev->map + pos;
+		} else {
+			buf = iobuf;
+			if(dev_read(dev, pos, buf, len) == -1)
+				return CFFS_ERR_IO;
+		}
+		if(sum)
+			*sum = file_sum(magic, *sum, buf, len);
+		if(outfd != -1 && write_all(outfd, buf, len) == -1)
+			return CFFS_ERR_OUTPUT;
+		pos += len;
+	}
+	return 0;
+}
+
+
+/* Find where the body of a file starts and ends on the device */
+static int file_extent(struct cffs_dev *dev, struct cffs_hdr *header, off_t *pos, off_t *end)
+{
+	file_bounds(header, pos, end);
+	if(*end > dev->size)
+		return CFFS_ERR_RANGE;
+
+	if(!dev->map && !dev->iobuf) {
+		dev->iobuf = malloc(STREAM_BUF_SZ);
+		if(!dev->iobuf)
+			return CFFS_ERR_NOMEM;
+	}
+	return 0;
+}
+
+
+static int stream_file(struct cffs_dev *dev, struct cffs_hdr *header, int outfd, uint32_t *sum)
+{
+	off_t pos, end;
+	int ret;
+
+	ret = file_extent(dev, header, &pos, &end);
+	if(ret)
+		return ret;
+	return stream_range(dev, pos, end, dev->iobuf, outfd, header->magic, sum);
+}
+
+
+/* Errors that mean a zero copy method is not supported for these fds */
+static int copy_unsupported(int err)
+{
+	return err == EINVAL || err == EXDEV || err == ENOSYS || err == EOPNOTSUPP
+		|| err == EBADF || err == ESPIPE;
+}
+
+
+/* copy_file_range and sendfile do not say which fd failed, so read the
+ * device where the copy stopped to find out
+ */
+static int copy_err(struct cffs_dev *dev, off_t pos)
+{
+	uint8_t byte;
+
+	return (dev_read(dev, pos, &byte, 1) == -1) ? CFFS_ERR_IO : CFFS_ERR_OUTPUT;
+}
+
+
+/* Copy a file body to outfd without bringing it into user space. Tries
+ * copy_file_range, then sendfile, then splice through a pipe and finally
+ * falls back to a read/write loop, each carrying on where the last one
+ * stopped.
+ */
+static int copy_file(struct cffs_dev *dev, struct cffs_hdr *header, int outfd)
+{
+	off_t pos, end;
+	ssize_t ret;
+	int pfd[2];
+
+	ret = file_extent(dev, header, &pos, &end);
+	if(ret)
+		return ret;
+	ret = -1;
+
+	while(pos < end) {
+		ret = copy_file_range(dev->fd, &pos, outfd, NULL, end - pos, 0);
+		if(ret > 0)
+			continue;
+		if(ret == -1 && errno == EINTR)
+			continue;
+		break;
+	}
+	if(pos < end && ret == -1 && !copy_unsupported(errno))
+		return copy_err(dev, pos);
+
+	while(pos < end) {
+		ret = sendfile(outfd, dev->fd, &pos, end - pos);
+		if(ret > 0)
+			continue;
+		if(ret == -1 && errno == EINTR)
+			continue;
+		break;
+	}
+	if(pos < end && ret == -1 && !copy_unsupported(errno))
+		return copy_err(dev, pos);
+
+	if(pos < end && pipe(pfd) == 0) {
+		while(pos < end) {
+			ret = splice(dev->fd, &pos, pfd[1], NULL, end - pos, SPLICE_F_MOVE);
+			if(ret == -1 && errno == EINTR)
+				continue;
+			if(ret <= 0)
+				break;
+			/* Drain the pipe into the output */
+			while(ret > 0) {
+				ssize_t out = splice(pfd[0], NULL, outfd, NULL, ret, SPLICE_F_MOVE);
+				if(out == -1 && errno == EINTR)
+					continue;
+				if(out <= 0) {
+					close(pfd[0]);
+					close(pfd[1]);
+					return CFFS_ERR_OUTPUT;
+				}
+				ret -= out;
+			}
+		}
+		close(pfd[0]);
+		close(pfd[1]);
+		/* Only the splice from the device is left failed here */
+		if(pos < end && ret == -1 && !copy_unsupported(errno))
+			return CFFS_ERR_IO;
+	}
+
+	if(pos < end)
+		return stream_range(dev, pos, end, dev->iobuf, outfd, 0, NULL);
+	return 0;
+}
+
+
+/* Read and decode a single header with one read */
+static int read_header(struct cffs_dev *dev, off_t pos, struct cffs_hdr *header)
+{
+	uint8_t buf[sizeof(struct ca_hdr)];
+	size_t len = sizeof(buf);
+
+	header->pos = pos;
+	if(pos < 0 || pos >= dev->size)
+		return -1;
+	if(pos + (off_t)len > dev->size)
+		len = dev->size - pos;
+
+	if(dev->map)
+		return decode_header(dev->map + pos, len, pos, header) ? -1 : 0;
+
+	if(dev_read(dev, pos, buf, len) == -1)
+		return -1;
+	return decode_header(buf, len, pos, header) ? -1 : 0;
+}
+
+
+/* Read-ahead window for walking the header chain. The rest of the erase
+ * block holding a header is read in one go so the following headers of
+ * small files can be decoded from memory.
+ */
+struct hdr_scanner {
+	struct cffs_dev	*dev;
+	uint8_t		*buf;		/* erasesize bytes, NULL if mapped */
+	off_t		start;		/* device offset of buf */
+	size_t		len;		/* valid bytes in buf */
+};
+
+
+static void scanner_init(struct hdr_scanner *sc, struct cffs_dev *dev)
+{
+	sc->dev = dev;
+	sc->buf = NULL;
+	sc->start = 0;
+	sc->len = 0;
+	if(!dev->map)
+		sc->buf = malloc(dev->erasesize);
+}
+
+
+static void scanner_free(struct hdr_scanner *sc)
+{
+	free(sc->buf);
+	sc->buf = NULL;
+}
+
+
+static int scan_header(struct hdr_scanner *sc, off_t pos, struct cffs_hdr *header)
+{
+	struct cffs_dev *dev = sc->dev;
+	off_t end;
+	int ret;
+
+	/* Mapped devices and failed allocations go straight to the device */
+	if(!sc->buf)
+		return read_header(dev, pos, header);
+
+	header->pos = pos;
+	if(pos < 0 || pos >= dev->size)
+		return -1;
+
+	if(pos < sc->start || pos >= sc->start + (off_t)sc->len) {
+		end = (pos / dev->erasesize + 1) * dev->erasesize;
+		if(end > dev->size)
+			end = dev->size;
+		sc->len = 0;
+		if(dev_read(dev, pos, sc->buf, end - pos) == -1)
+			return -1;
+		sc->start = pos;
+		sc->len = end - pos;
+	}
+
+	ret = decode_header(sc->buf + (pos - sc->start), sc->start + sc->len - pos, pos, header);
+	if(ret == -2 && sc->start + (off_t)sc->len < dev->size) {
+		/* Header crosses the end of the window */
+		return read_header(dev, pos, header);
+	}
+	return ret ? -1 : 0;
+}
+
+
+/*
+ * Source file pipeline for put. A reader thread fills a ring of
+ * STREAM_BUF_SZ buffers from the source file while the caller checksums
+ * and programs the previous ones, so source I/O overlaps the flash writes.
+ */
+#define PUT_BUFS 4
+
+struct put_pipe {
+	int		fd;
+	off_t		size;		/* bytes to read from fd */
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	uint8_t		*buf[PUT_BUFS];
+	size_t		len[PUT_BUFS];
+	int		head;		/* next buffer for the reader */
+	int		tail;		/* next buffer for the writer */
+	int		filled;		/* buffers waiting for the writer */
+	int		err;		/* errno from the reader */
+	int		eof;		/* reader has finished */
+	int		stop;		/* writer has given up */
+};
+
+
+static void *pipe_reader(void *arg)
+{
+	struct put_pipe *pp = arg;
+	off_t done = 0;
+	size_t want, got;
+	ssize_t red;
+	int slot, stop, err = 0;
+
+	while(done < pp->size && !err) {
+		pthread_mutex_lock(&pp->lock);
+		while(pp->filled == PUT_BUFS && !pp->stop)
+			pthread_cond_wait(&pp->cond, &pp->lock);
+		slot = pp->head;
+		stop = pp->stop;
+		pthread_mutex_unlock(&pp->lock);
+		if(stop)
+			break;
+
+		want = (pp->size - done > STREAM_BUF_SZ) ? STREAM_BUF_SZ : pp->size - done;
+		for(got = 0; got < want; got += red) {
+			red = read(pp->fd, pp->buf[slot] + got, want - got);
+			if(red == -1 && errno == EINTR) {
+				red = 0;
+				continue;
+			}
+			if(red <= 0) {
+				/* The file got shorter while we were reading it */
+				err = red ? errno : EIO;
+				break;
+			}
+		}
+
+		pthread_mutex_lock(&pp->lock);
+		if(err) {
+			pp->err = err;
+		} else {
+			pp->len[slot] = got;
+			pp->head = (slot + 1) % PUT_BUFS;
+			pp->filled++;
+		}
+		pthread_cond_broadcast(&pp->cond);
+		pthread_mutex_unlock(&pp->lock);
+		done += got;
+	}
+
+	pthread_mutex_lock(&pp->lock);
+	pp->eof = 1;
+	pthread_cond_broadcast(&pp->cond);
+	pthread_mutex_unlock(&pp->lock);
+	return NULL;
+}
+
+
+static int pipe_open(struct put_pipe *pp, int fd, off_t size)
+{
+	int cnt;
+
+	memset(pp, 0, sizeof(struct put_pipe));
+	pp->fd = fd;
+	pp->size = size;
+	for(cnt = 0; cnt < PUT_BUFS; cnt++) {
+		pp->buf[cnt] = malloc(STREAM_BUF_SZ);
+		if(!pp->buf[cnt])
+			goto pipe_err;
+	}
+	pthread_mutex_init(&pp->lock, NULL);
+	pthread_cond_init(&pp->cond, NULL);
+	if(pthread_create(&pp->thread, NULL, pipe_reader, pp)) {
+		pthread_cond_destroy(&pp->cond);
+		pthread_mutex_destroy(&pp->lock);
+		goto pipe_err;
+	}
+	return 0;
+
+ pipe_err:
+	for(cnt = 0; cnt < PUT_BUFS; cnt++)
+		free(pp->buf[cnt]);
+	return -1;
+}
+
+
+/* Returns 1 with the next buffer, 0 at the end of the file or -1 if the
+ * read failed. Each buffer must be handed back with pipe_release().
+ */
+static int pipe_next(struct put_pipe *pp, uint8_t **buf, size_t *len)
+{
+	int ret;
+
+	pthread_mutex_lock(&pp->lock);
+	while(!pp->filled && !pp->eof)
+		pthread_cond_wait(&pp->cond, &pp->lock);
+	if(pp->filled) {
+		*buf = pp->buf[pp->tail];
+		*len = pp->len[pp->tail];
+		ret = 1;
+	} else {
+		errno = pp->err;
+		ret = pp->err ? -1 : 0;
+	}
+	pthread_mutex_unlock(&pp->lock);
+	return ret;
+}
+
+
+static void pipe_release(struct put_pipe *pp)
+{
+	pthread_mutex_lock(&pp->lock);
+	pp->tail = (pp->tail + 1) % PUT_BUFS;
+	pp->filled--;
+	pthread_cond_broadcast(&pp->cond);
+	pthread_mutex_unlock(&pp->lock);
+}
+
+
+static void pipe_close(struct put_pipe *pp)
+{
+	int cnt;
+
+	pthread_mutex_lock(&pp->lock);
+	pp->stop = 1;
+	pthread_cond_broadcast(&pp->cond);
+	pthread_mutex_unlock(&pp->lock);
+	pthread_join(pp->thread, NULL);
+
+	pthread_cond_destroy(&pp->cond);
+	pthread_mutex_destroy(&pp->lock);
+	for(cnt = 0; cnt < PUT_BUFS; cnt++)
+		free(pp->buf[cnt]);
+}
+
+
+/*
+ * Coalescing writer for put. Data is staged in an erase block sized
+ * buffer and written out a block at a time, so a batch of files goes to
+ * the flash as a few large erase block aligned writes. Gaps are left as
+ * 0xFF, which programming leaves unchanged.
+ */
+struct block_writer {
+	struct cffs_dev	*dev;
+	uint8_t		*buf;
+	off_t		start;		/* device offset of buf, erase block aligned */
+	size_t		lo;		/* staged bytes are buf[lo..hi) */
+	size_t		hi;
+};
+
+
+static int bw_init(struct block_writer *bw, struct cffs_dev *dev, off_t pos)
+{
+	bw->dev = dev;
+	bw->buf = malloc(dev->erasesize);
+	if(!bw->buf)
+		return -1;
+	memset(bw->buf, 0xff, dev->erasesize);
+	bw->start = pos - pos % dev->erasesize;
+	bw->lo = bw->hi = pos - bw->start;
+	return 0;
+}
+
+
+static int bw_flush(struct block_writer *bw)
+{
+	int ret = 0;
+
+	if(bw->hi > bw->lo)
+		ret = dev_write(bw->dev, bw->start + bw->lo, bw->buf + bw->lo, bw->hi - bw->lo);
+	memset(bw->buf, 0xff, bw->dev->erasesize);
+	bw->lo = bw->hi = 0;
+	return ret;
+}
+
+
+/* Stage data at off, which must not be before anything already staged */
+static int bw_write(struct block_writer *bw, off_t off, const uint8_t *data, size_t len)
+{
+	size_t part, boff;
+
+	while(len) {
+		if(off >= bw->start + bw->dev->erasesize) {
+			if(bw_flush(bw) == -1)
+				return -1;
+			bw->start = off - off % bw->dev->erasesize;
+		}
+		boff = off - bw->start;
+		part = bw->dev->erasesize - boff;
+		if(part > len)
+			part = len;
+		if(bw->hi == bw->lo)
+			bw->lo = boff;
+		memcpy(bw->buf + boff, data, part);
+		bw->hi = boff + part;
+		off += part;
+		data += part;
+		len -= part;
+	}
+	return 0;
+}
+
+
+/* Fill in data behind the staging point, such as a header once its file
+ * has been checksummed. Anything before the current block has already been
+ * written out as 0xFF so it is programmed directly.
+ */
+static int bw_patch(struct block_writer *bw, off_t off, const uint8_t *data, size_t len)
+{
+	size_t part;
+
+	if(off < bw->start) {
+		part = (off + (off_t)len > bw->start) ? bw->start - off : len;
+		if(dev_write(bw->dev, off, data, part) == -1)
+			return -1;
+		off += part;
+		data += part;
+		len -= part;
+	}
+	if(len) {
+		if(bw->hi == bw->lo || (size_t)(off - bw->start) < bw->lo)
+			bw->lo = off - bw->start;
+		if(bw->hi < off - bw->start + len)
+			bw->hi = off - bw->start + len;
+		memcpy(bw->buf + (off - bw->start), data, len);
+	}
+	return 0;
+}
+
+
+struct put_plan {
+	char		*fname;
+	int		fd;
+	struct cffs_hdr	header;
+};
+
+
+/* Put a batch of files at *pos. Every file is opened and the final layout
+ * worked out before anything is written, so a batch that does not fit or
+ * has a source that cant be read is rejected without touching the flash. *pos is updated to the end of the
+ * last file written.
+ */
+static int put_files(cffs_t *h, off_t *pos, char **files, int filecnt, uint32_t magic)
+{
+	struct cffs_dev *dev = &h->dev;
+	struct put_plan *plan;
+	struct block_writer bw;
+	struct put_pipe pp;
+	struct stat sinfo;
+	uint8_t hbuf[sizeof(struct ca_hdr)], *buf;
+	size_t len;
+	off_t end = *pos, wpos;
+	int hlen = (magic == CISCO_CLASSB) ? sizeof(struct cb_hdr) : sizeof(struct ca_hdr);
+	int cnt, planned = 0, ret = 0, red;
+	uint32_t sum;
+
+	plan = calloc(filecnt ? filecnt : 1, sizeof(struct put_plan));
+	if(!plan)
+		return set_err(h, CFFS_ERR_NOMEM, "Out of memory");
+
+	for(cnt = 0; cnt < filecnt; cnt++) {
+		char *fname = files[cnt];
+		int fd = open(fname, O_RDONLY);
+
+		if(fd == -1) {
+			ret = set_err(h, CFFS_ERR_SOURCE, "Cant open %s: %s", fname, strerror(errno));
+			goto put_done;
+		}
+		if(fstat(fd, &sinfo) == -1) {
+			ret = set_err(h, CFFS_ERR_SOURCE, "Cant stat %s: %s", fname, strerror(errno));
+			close(fd);
+			goto put_done;
+		}
+		if(!S_ISREG(sinfo.st_mode)) {
+			ret = set_err(h, CFFS_ERR_SOURCE, "Cant put %s, not a file", fname);
+			close(fd);
+			goto put_done;
+		}
+		plan[planned].fname = fname;
+		plan[planned].fd = fd;
+		make_header(&plan[planned].header, magic, end, fname, sinfo.st_size);
+		end = (end + hlen + sinfo.st_size + 3) & ~3;
+		planned++;
+	}
+
+	if(end > dev->size) {
+		ret = set_err(h, CFFS_ERR_NOSPC, "Not enough space, %ld bytes needed and %ld free",
+			      (long)(end - *pos), (long)(dev->size - *pos));
+		goto put_done;
+	}
+	if(bw_init(&bw, dev, *pos) == -1) {
+		ret = set_err(h, CFFS_ERR_NOMEM, "Out of memory");
+		goto put_done;
+	}
+
+	for(cnt = 0; cnt < planned && !ret; cnt++) {
+		struct cffs_hdr *header = &plan[cnt].header;
+
+		log_msg(h, CFFS_LOG_INFO, "Adding file: %s", plan[cnt].fname);
+		wpos = header->pos + hlen;
+		sum = 0;
+		if(pipe_open(&pp, plan[cnt].fd, header->magic == CISCO_CLASSB ?
+			     header->hdr.cbfh.length : header->hdr.cafh.length) == -1) {
+			ret = set_err(h, CFFS_ERR_NOMEM, "Out of memory");
+			break;
+		}
+		while((red = pipe_next(&pp, &buf, &len)) == 1) {
+			sum = file_sum(magic, sum, buf, len);
+			if(bw_write(&bw, wpos, buf, len) == -1) {
+				ret = io_err(h, "write");
+				break;
+			}
+			wpos += len;
+			pipe_release(&pp);
+		}
+		pipe_close(&pp);
+		if(red == -1)
+			ret = set_err(h, CFFS_ERR_SOURCE, "Cant read in all of file %s: %s",
+				      plan[cnt].fname, strerror(errno));
+		if(red)
+			break;
+
+		/* Header goes in last, now the checksum is known */
+		if(magic == CISCO_CLASSB)
+			header->hdr.cbfh.chksum = sum;
+		else
+			header->hdr.cafh.crc = sum;
+		if(bw_patch(&bw, header->pos, hbuf, encode_header(header, hbuf)) == -1) {
+			ret = io_err(h, "write");
+			break;
+		}
+		*pos = wpos;
+	}
+	if(bw_flush(&bw) == -1 && !ret)
+		ret = io_err(h, "write");
+	free(bw.buf);
+
+ put_done:
+	for(cnt = 0; cnt < planned; cnt++)
+		close(plan[cnt].fd);
+	free(plan);
+	return ret;
+}
+
+
+static int delete_file(cffs_t *h, struct cffs_hdr *header)
+{
+	struct cffs_dev *dev = &h->dev;
+	uint16_t flag;
+	off_t pos;
+
+	if(header->magic == CISCO_CLASSB) {
+		if(!(header->hdr.cbfh.flags & FLAG_DELETED)) {
+			return 0;
+		}
+		header->hdr.cbfh.flags &= ~FLAG_DELETED;
+		flag = htons(header->hdr.cbfh.flags);
+		pos = header->pos + 10;
+	} else {
+		return set_err(h, CFFS_ERR_UNSUPP, "Cant delete %s, only Class B files can be deleted",
+			       header_name(header));
+	}
+	if(dev_write(dev, pos, &flag, sizeof(flag)) == -1)
+		return io_err(h, "write");
+	
+	if(read_header(dev, header->pos, header) == -1)
+		return set_err(h, CFFS_ERR_IO, "read_header failed");
+
+	if(!(header->hdr.cbfh.flags & FLAG_DELETED))
+		return 0;
+	return set_err(h, CFFS_ERR_IO, "Failed to delete file %s", header_name(header));
+}
+
+
+/* Erase a run of blocks with one MEMERASE. Drivers that only take a
+ * single block at a time get it a block at a time instead.
+ */
+static int erase_range(struct cffs_dev *dev, off_t start, off_t len)
+{
+	off_t off;
+	uint32_t part;
+
+	if(dev_erase(dev, start, len) == 0)
+		return 0;
+	if(!dev->is_mtd || errno != EINVAL || len <= dev->erasesize)
+		return -1;
+
+	for(off = start; off < start + len; off += dev->erasesize) {
+		part = dev->erasesize;
+		if(off + part > start + len)
+			part = start + len - off;
+		if(dev_erase(dev, off, part) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+
+/* Returns 1 if the block at start is all 0xFF, 0 if not and -1 on error */
+static int block_is_blank(struct cffs_dev *dev, off_t start, uint32_t len, uint8_t *buf)
+{
+	uint8_t *p = buf;
+
+	if(dev->map)
+		p = dev->map + start;
+	else if(dev_read(dev, start, buf, len) == -1)
+		return -1;
+	return find_nonblank(p, len) == len;
+}
+
+
+/* With quick set, blocks that are already blank are left alone and each
+ * run of dirty blocks goes in one erase request.
+ */
+static int erase_device(cffs_t *h, int quick, struct cffs_erase_stats *stats)
+{
+	struct cffs_dev *dev = &h->dev;
+	int blocks, cnt, blank;
+	off_t start, run = -1;
+	uint8_t *buf = NULL;
+
+	if(!dev->size)
+		return set_err(h, CFFS_ERR_INVAL, "Device is empty");
+
+	blocks =  (dev->size + dev->erasesize - 1) / dev->erasesize;
+	stats->blocks = blocks;
+
+	if(quick && !dev->map) {
+		buf = malloc(dev->erasesize);
+		if(!buf)
+			return set_err(h, CFFS_ERR_NOMEM, "Out of memory");
+	}
+
+	start = 0;
+	for(cnt = 0; cnt <= blocks; cnt++) {
+		uint32_t len = dev->erasesize;
+
+		/* Image files need not be a whole number of blocks */
+		if(start + len > dev->size)
+			len = dev->size - start;
+
+		if(!quick) {
+			if(cnt == blocks)
+				break;
+			progress(h, CFFS_PROG_ERASE, cnt+1, blocks);
+			if(dev_erase(dev, start, len) == -1)
+				return io_err(h, "erase");
+			stats->erased++;
+			start += dev->erasesize;
+			continue;
+		}
+
+		/* One past the last block ends any run still open */
+		blank = 1;
+		if(cnt < blocks) {
+			progress(h, CFFS_PROG_ERASE_CHECK, cnt+1, blocks);
+			blank = block_is_blank(dev, start, len, buf);
+			if(blank == -1) {
+				free(buf);
+				return io_err(h, "read");
+			}
+		}
+		if(!blank && run == -1)
+			run = start;
+		if(blank && run != -1) {
+			if(erase_range(dev, run, start - run) == -1) {
+				free(buf);
+				return io_err(h, "erase");
+			}
+			stats->erased += (start - run + dev->erasesize - 1) / dev->erasesize;
+			stats->ranges++;
+			run = -1;
+		}
+		start += len;
+	}
+	free(buf);
+	return 0;
+}
+
+
+/* Walk the header chain from *tail, appending each header to *hdrs.
+ * On return *tail is the offset of the free space.
+ */
+static int scan_chain(struct cffs_dev *dev, struct cffs_hdr **hdrs, int *count, off_t *tail)
+{
+	struct hdr_scanner sc;
+	struct cffs_hdr header, *grown;
+	int alloced = *count;
+
+	scanner_init(&sc, dev);
+	while(scan_header(&sc, *tail, &header) != -1) {
+		if(*count == alloced) {
+			alloced += 64;
+			grown = realloc(*hdrs, alloced * sizeof(struct cffs_hdr));
+			if(!grown) {
+				scanner_free(&sc);
+				return CFFS_ERR_NOMEM;
+			}
+			*hdrs = grown;
+		}
+		(*hdrs)[(*count)++] = header;
+		*tail = next_header_pos(&header);
+	}
+	scanner_free(&sc);
+	return 0;
+}
+
+
+/*
+ * Sidecar header index. A compact copy of the header chain kept in a file
+ * so later runs do not have to walk the chain. It is only used while the
+ * size and mtime of the device and a hash of its first INDEX_CHECK
+ * headers, last header and the start of the free space still match,
+ * otherwise it is rebuilt. The mtime of an MTD device does not change
+ * when the card is written somewhere else, so the hash is what catches
+ * a card that has been rewritten.
+ */
+#define INDEX_MAGIC	0x58444943	/* "CIDX" */
+#define INDEX_VERSION	3
+#define INDEX_CHECK	16
+
+struct index_head {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	size;
+	int64_t		mtime;
+	int64_t		mtime_nsec;
+	uint64_t	hash;
+	uint64_t	tail;		/* offset of the free space */
+	uint32_t	count;
+	uint32_t	pad;
+};
+
+/* Headers are kept in their on-flash form so every field comes back */
+struct index_entry {
+	uint64_t	pos;
+	uint8_t		hdr[sizeof(struct ca_hdr)];
+};
+
+
+static uint64_t fnv1a(uint64_t hash, const uint8_t *buf, size_t len)
+{
+	while(len--) {
+		hash ^= *buf++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+
+static int index_hash(struct cffs_dev *dev, struct cffs_hdr *hdrs, int count, off_t tail,
+	       uint64_t *hash)
+{
+	uint8_t buf[sizeof(struct ca_hdr)];
+	uint64_t h = 0xcbf29ce484222325ULL;
+	off_t len;
+	int cnt;
+
+	len = (dev->size < (off_t)sizeof(buf)) ? dev->size : (off_t)sizeof(buf);
+	if(dev_read(dev, 0, buf, len) == -1)
+		return -1;
+	h = fnv1a(h, buf, len);
+
+	/* The headers the index has, read back from where it says they are */
+	for(cnt = 0; cnt < count; cnt++) {
+		struct cffs_hdr *hdr;
+
+		if(cnt == INDEX_CHECK)
+			cnt = count - 1;
+		hdr = &hdrs[cnt];
+		len = (hdr->magic == CISCO_CLASSB) ? sizeof(struct cb_hdr) : sizeof(struct ca_hdr);
+		if(dev_read(dev, hdr->pos, buf, len) == -1)
+			return -1;
+		h = fnv1a(h, buf, len);
+	}
+
+	h = fnv1a(h, (uint8_t *)&tail, sizeof(tail));
+	len = (dev->size - tail < 16) ? dev->size - tail : 16;
+	if(dev_read(dev, tail, buf, len) == -1)
+		return -1;
+	*hash = fnv1a(h, buf, len);
+	return 0;
+}
+
+
+/* Returns 0 if the index was loaded, -1 if it is missing or stale */
+static int index_load(char *path, struct cffs_dev *dev, struct cffs_hdr **hdrs, int *count,
+	       off_t *tail)
+{
+	FILE *fp;
+	struct index_head head;
+	struct index_entry e;
+	struct cffs_hdr *h;
+	struct stat sinfo;
+	uint64_t hash;
+	uint32_t cnt;
+
+	fp = fopen(path, "r");
+	if(!fp)
+		return -1;
+	if(fread(&head, sizeof(head), 1, fp) != 1 || head.magic != INDEX_MAGIC
+	   || head.version != INDEX_VERSION)
+		goto stale;
+
+	if(fstat(dev->fd, &sinfo) == -1 || head.size != (uint64_t)dev->size
+	   || head.mtime != sinfo.st_mtim.tv_sec || head.mtime_nsec != sinfo.st_mtim.tv_nsec
+	   || head.tail > head.size)
+		goto stale;
+
+	*hdrs = calloc(head.count ? head.count : 1, sizeof(struct cffs_hdr));
+	if(!*hdrs)
+		goto stale;
+	for(cnt = 0; cnt < head.count; cnt++) {
+		if(fread(&e, sizeof(e), 1, fp) != 1)
+			goto stale_free;
+		h = &(*hdrs)[cnt];
+		if(decode_header(e.hdr, sizeof(e.hdr), e.pos, h))
+			goto stale_free;
+	}
+
+	if(index_hash(dev, *hdrs, head.count, head.tail, &hash) == -1 || hash != head.hash)
+		goto stale_free;
+
+	fclose(fp);
+	*count = head.count;
+	*tail = head.tail;
+	return 0;
+
+ stale_free:
+	free(*hdrs);
+	*hdrs = NULL;
+ stale:
+	fclose(fp);
+	return -1;
+}
+
+
+static int index_save(char *path, struct cffs_dev *dev, struct cffs_hdr *hdrs, int count,
+	       off_t tail)
+{
+	FILE *fp;
+	struct index_head head;
+	struct index_entry e;
+	struct stat sinfo;
+	char *tmp;
+	int cnt, ok;
+
+	memset(&head, 0, sizeof(head));
+	head.magic = INDEX_MAGIC;
+	head.version = INDEX_VERSION;
+	head.size = dev->size;
+	head.tail = tail;
+	head.count = count;
+	if(fstat(dev->fd, &sinfo) == -1 || index_hash(dev, hdrs, count, tail, &head.hash) == -1)
+		return -1;
+	head.mtime = sinfo.st_mtim.tv_sec;
+	head.mtime_nsec = sinfo.st_mtim.tv_nsec;
+
+	/* Write a new file and rename it so readers never see half an index */
+	tmp = malloc(strlen(path) + 5);
+	if(!tmp)
+		return -1;
+	sprintf(tmp, "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if(!fp) {
+		free(tmp);
+		return -1;
+	}
+	ok = fwrite(&head, sizeof(head), 1, fp) == 1;
+	for(cnt = 0; ok && cnt < count; cnt++) {
+		e.pos = hdrs[cnt].pos;
+		ok = encode_header(&hdrs[cnt], e.hdr) != -1 && fwrite(&e, sizeof(e), 1, fp) == 1;
+	}
+	/* A short index must not replace a good one */
+	if(fclose(fp) == EOF)
+		ok = 0;
+	if(!ok || rename(tmp, path) == -1) {
+		int err = errno;
+
+		unlink(tmp);
+		errno = err;
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+
+/* Checksum each file in turn, counting them and the bad ones in res */
+static int fsck_files(cffs_t *h, cffs_fsck_fn fn, void *arg, off_t *curpos,
+		      struct cffs_fsck_result *res)
+{
+	struct cffs_dev *dev = &h->dev;
+	struct hdr_scanner sc;
+	struct cffs_hdr header;
+	uint32_t sum;
+	int ret;
+
+	/* scan_header() stops at the first thing that is not a header, the
+	 * blank check after this reports it if it is not the free space
+	 */
+	scanner_init(&sc, dev);
+	while(scan_header(&sc, *curpos, &header) != -1) {
+		ret = stream_file(dev, &header, -1, &sum);
+		if(ret) {
+			ret = file_err(h, ret, &header);
+			goto fsck_err;
+		}
+		if(fn)
+			fn(arg, &header, sum);
+		res->files++;
+		if(sum != header_sum(&header))
+			res->bad++;
+
+		*curpos = next_header_pos(&header);
+	}
+	scanner_free(&sc);
+	return 0;
+
+ fsck_err:
+	scanner_free(&sc);
+	return ret;
+}
+
+
+/* Parallel fsck. The calling thread walks the header chain and queues a
+ * job per file, the workers checksum them with pread (or from the
+ * mapping) and the results are reported in the order they are on flash.
+ */
+enum job_state { JOB_QUEUED = 0, JOB_DONE, JOB_FAILED };
+
+struct fsck_job {
+	struct cffs_hdr	header;
+	uint32_t	sum;
+	enum job_state	state;
+};
+
+struct fsck_pool {
+	struct cffs_dev	*dev;
+	pthread_mutex_t	lock;
+	pthread_cond_t	queued;		/* a job was added or the walk ended */
+	pthread_cond_t	done;		/* a job was completed */
+	struct fsck_job	*jobs;
+	int		count;
+	int		alloced;
+	int		next;		/* next job to hand to a worker */
+	int		walked;		/* all jobs have been queued */
+};
+
+struct fsck_worker {
+	pthread_t	thread;
+	struct fsck_pool *pool;
+	uint8_t		*iobuf;
+};
+
+
+static void *fsck_worker(void *arg)
+{
+	struct fsck_worker *w = arg;
+	struct fsck_pool *pool = w->pool;
+	struct cffs_hdr header;
+	uint32_t sum;
+	off_t pos, end;
+	int n, ret;
+
+	pthread_mutex_lock(&pool->lock);
+	while(1) {
+		while(pool->next == pool->count && !pool->walked)
+			pthread_cond_wait(&pool->queued, &pool->lock);
+		if(pool->next == pool->count)
+			break;
+		n = pool->next++;
+		header = pool->jobs[n].header;
+		pthread_mutex_unlock(&pool->lock);
+
+		file_bounds(&header, &pos, &end);
+		ret = stream_range(pool->dev, pos, end, w->iobuf, -1, header.magic, &sum);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->jobs[n].sum = sum;
+		pool->jobs[n].state = ret ? JOB_FAILED : JOB_DONE;
+		pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+
+static int fsck_queue(struct fsck_pool *pool, struct cffs_hdr *header)
+{
+	struct fsck_job *jobs;
+	int ret = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	if(pool->count == pool->alloced) {
+		jobs = realloc(pool->jobs, (pool->alloced + 64) * sizeof(struct fsck_job));
+		if(!jobs) {
+			ret = -1;
+			goto out;
+		}
+		pool->jobs = jobs;
+		pool->alloced += 64;
+	}
+	memset(&pool->jobs[pool->count], 0, sizeof(struct fsck_job));
+	pool->jobs[pool->count++].header = *header;
+	pthread_cond_signal(&pool->queued);
+ out:
+	pthread_mutex_unlock(&pool->lock);
+	return ret;
+}
+
+
+static int fsck_files_parallel(cffs_t *h, int jobs, cffs_fsck_fn fn, void *arg,
+			       off_t *curpos, struct cffs_fsck_result *res)
+{
+	struct cffs_dev *dev = &h->dev;
+	struct fsck_pool pool;
+	struct fsck_worker *workers;
+	struct hdr_scanner sc;
+	struct cffs_hdr header;
+	int started, cnt, ret = 0;
+
+	workers = calloc(jobs, sizeof(struct fsck_worker));
+	if(!workers)
+		return set_err(h, CFFS_ERR_NOMEM, "Out of memory");
+	memset(&pool, 0, sizeof(pool));
+	pool.dev = dev;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.queued, NULL);
+	pthread_cond_init(&pool.done, NULL);
+
+	for(started = 0; started < jobs; started++) {
+		workers[started].pool = &pool;
+		if(!dev->map) {
+			workers[started].iobuf = malloc(STREAM_BUF_SZ);
+			if(!workers[started].iobuf)
+				break;
+		}
+		if(pthread_create(&workers[started].thread, NULL, fsck_worker, &workers[started])) {
+			free(workers[started].iobuf);
+			break;
+		}
+	}
+	if(!started) {
+		free(workers);
+		return fsck_files(h, fn, arg, curpos, res);
+	}
+
+	scanner_init(&sc, dev);
+	while(scan_header(&sc, *curpos, &header) != -1) {
+		off_t pos, end;
+
+		file_bounds(&header, &pos, &end);
+		if(end > dev->size) {
+			ret = file_err(h, CFFS_ERR_RANGE, &header);
+			break;
+		}
+		if(fsck_queue(&pool, &header) == -1) {
+			ret = set_err(h, CFFS_ERR_NOMEM, "Out of memory");
+			break;
+		}
+		*curpos = next_header_pos(&header);
+	}
+	scanner_free(&sc);
+
+	pthread_mutex_lock(&pool.lock);
+	pool.walked = 1;
+	pthread_cond_broadcast(&pool.queued);
+
+	/* Report in on-flash order */
+	for(cnt = 0; cnt < pool.count; cnt++) {
+		struct fsck_job *job = &pool.jobs[cnt];
+
+		while(job->state == JOB_QUEUED)
+			pthread_cond_wait(&pool.done, &pool.lock);
+		if(job->state == JOB_FAILED) {
+			ret = set_err(h, CFFS_ERR_IO, "Cant read %s", header_name(&job->header));
+			break;
+		}
+		if(fn)
+			fn(arg, &job->header, job->sum);
+		res->files++;
+		if(job->sum != header_sum(&job->header))
+			res->bad++;
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	for(cnt = 0; cnt < started; cnt++) {
+		pthread_join(workers[cnt].thread, NULL);
+		free(workers[cnt].iobuf);
+	}
+	free(workers);
+	free(pool.jobs);
+	pthread_cond_destroy(&pool.done);
+	pthread_cond_destroy(&pool.queued);
+	pthread_mutex_destroy(&pool.lock);
+	return ret;
+}
+
+
+/* Free space is tested TEST_BUF_SZ bytes at a time */
+#define TEST_BUF_SZ (1<<20)
+
+struct blank_shared {
+	pthread_mutex_t	lock;
+	off_t		first;		/* lowest non blank offset found so far */
+};
+
+struct blank_range {
+	pthread_t	thread;
+	cffs_t		*h;
+	struct cffs_dev	*dev;
+	struct blank_shared *shared;
+	off_t		start;
+	off_t		end;
+	off_t		found;		/* first non blank offset, or end */
+	int		progress;	/* report progress as it goes */
+	int		err;
+};
+
+
+static void *blank_scan(void *arg)
+{
+	struct blank_range *r = arg;
+	struct blank_shared *shared = r->shared;
+	struct cffs_dev *dev = r->dev;
+	uint8_t *buf = NULL, *p;
+	off_t pos = r->start, first;
+	size_t len, off;
+
+	r->found = r->end;
+	if(!dev->map && posix_memalign((void **)&buf, 4096, TEST_BUF_SZ)) {
+		r->err = 1;
+		return NULL;
+	}
+
+	while(pos < r->end) {
+		len = (r->end - pos > TEST_BUF_SZ) ? TEST_BUF_SZ : r->end - pos;
+		if(dev->map) {
+			p = dev->map + pos;
+		} else {
+			p = buf;
+			if(dev_read(dev, pos, buf, len) == -1) {
+				r->err = 1;
+				break;
+			}
+		}
+		off = find_nonblank(p, len);
+		if(off < len) {
+			r->found = pos + off;
+			pthread_mutex_lock(&shared->lock);
+			if(r->found < shared->first)
+				shared->first = r->found;
+			pthread_mutex_unlock(&shared->lock);
+			break;
+		}
+		pos += len;
+		if(r->progress)
+			progress(r->h, CFFS_PROG_BLANK, pos - r->start, r->end - r->start);
+
+		/* Stop if a range before this one is already not blank */
+		pthread_mutex_lock(&shared->lock);
+		first = shared->first;
+		pthread_mutex_unlock(&shared->lock);
+		if(first < r->start)
+			break;
+	}
+	free(buf);
+	return NULL;
+}
+
+
+/* Returns the offset of the first byte from start that is not 0xFF, the
+ * size of the device if it is all blank or -1 on error. Image files are
+ * split up between jobs threads, MTD devices are read by one.
+ */
+static off_t blank_check(cffs_t *h, off_t start, int jobs)
+{
+	struct cffs_dev *dev = &h->dev;
+	struct blank_shared shared;
+	struct blank_range *ranges;
+	off_t step, found = dev->size;
+	int threads, cnt, started, err = 0;
+
+	if(start >= dev->size)
+		return dev->size;
+
+	threads = (dev->is_mtd || jobs < 1) ? 1 : jobs;
+	if((dev->size - start) / threads < TEST_BUF_SZ)
+		threads = (dev->size - start + TEST_BUF_SZ - 1) / TEST_BUF_SZ;
+	step = ((dev->size - start) / threads + 4095) & ~4095;
+
+	ranges = calloc(threads, sizeof(struct blank_range));
+	if(!ranges)
+		return -1;
+	pthread_mutex_init(&shared.lock, NULL);
+	shared.first = dev->size;
+
+	for(cnt = 0; cnt < threads; cnt++) {
+		ranges[cnt].h = h;
+		ranges[cnt].dev = dev;
+		ranges[cnt].shared = &shared;
+		ranges[cnt].start = start + cnt * step;
+		ranges[cnt].end = start + (cnt + 1) * step;
+		if(ranges[cnt].start > dev->size)
+			ranges[cnt].start = dev->size;
+		if(ranges[cnt].end > dev->size || cnt == threads - 1)
+			ranges[cnt].end = dev->size;
+	}
+
+	if(threads == 1) {
+		ranges[0].progress = 1;
+		blank_scan(&ranges[0]);
+		started = 0;
+	} else {
+		for(started = 0; started < threads; started++) {
+			if(pthread_create(&ranges[started].thread, NULL, blank_scan, &ranges[started]))
+				break;
+		}
+		/* Scan whatever could not be given a thread here */
+		for(cnt = started; cnt < threads; cnt++)
+			blank_scan(&ranges[cnt]);
+	}
+
+	for(cnt = 0; cnt < threads; cnt++) {
+		if(cnt < started)
+			pthread_join(ranges[cnt].thread, NULL);
+		if(ranges[cnt].err)
+			err = 1;
+		if(ranges[cnt].found < ranges[cnt].end && ranges[cnt].found < found)
+			found = ranges[cnt].found;
+	}
+	pthread_mutex_destroy(&shared.lock);
+	free(ranges);
+
+	/* A read error after the first non blank byte does not matter */
+	if(err && found == dev->size)
+		return -1;
+	return found;
+}
+
+
+int cffs_open(cffs_t **hp, const char *device, int rdwr, struct nor_emul *emul)
+{
+	cffs_t *h;
+
+	*hp = h = calloc(1, sizeof(cffs_t));
+	if(!h)
+		return CFFS_ERR_NOMEM;
+	h->rdwr = rdwr;
+	if(open_device(device, rdwr ? O_RDWR : O_RDONLY, &h->dev, emul) == 0)
+		return CFFS_OK;
+
+	if(errno == ENODEV)
+		return set_err(h, CFFS_ERR_OPEN, "%s is not an MTD character device or image file",
+			       device);
+	if(errno == EINVAL && emul)
+		return set_err(h, CFFS_ERR_OPEN, "%s is a real MTD device, it cant be emulated",
+			       device);
+	return set_err(h, CFFS_ERR_OPEN, "Cant open %s: %s", device, strerror(errno));
+}
+
+
+int cffs_close(cffs_t *h)
+{
+	int ret;
+
+	if(!h)
+		return CFFS_OK;
+	ret = cffs_sync(h);
+	free(h->hdrs);
+	free(h->index);
+	close_device(&h->dev);
+	free(h);
+	return ret;
+}
+
+
+const char *cffs_strerror(int err)
+{
+	static const char *msgs[] = {
+		"Success",
+		"Device I/O error",
+		"Out of memory",
+		"Cant open device",
+		"Bad header magic",
+		"File extends past end of flash",
+		"Not enough space",
+		"Bad checksum",
+		"Flash is not blank",
+		"Invalid argument",
+		"Not supported on this file system",
+		"Cant read source file",
+		"Cant write output file"
+	};
+
+	if(err > 0 || -err >= (int)(sizeof(msgs) / sizeof(msgs[0])))
+		return "Unknown error";
+	return msgs[-err];
+}
+
+
+const char *cffs_errmsg(cffs_t *h)
+{
+	if(!h)
+		return cffs_strerror(CFFS_ERR_NOMEM);
+	return h->errmsg;
+}
+
+
+void cffs_set_callbacks(cffs_t *h, cffs_log_fn log, cffs_progress_fn progress, void *arg)
+{
+	h->log = log;
+	h->progress = progress;
+	h->cb_arg = arg;
+}
+
+
+void cffs_set_index(cffs_t *h, const char *path)
+{
+	free(h->index);
+	h->index = path ? strdup(path) : NULL;
+}
+
+
+void cffs_set_class_a(cffs_t *h, int allow)
+{
+	h->class_a = allow;
+}
+
+
+int cffs_sync(cffs_t *h)
+{
+	if(!h->index || !h->dirty)
+		return CFFS_OK;
+	if(index_save(h->index, &h->dev, h->hdrs, h->count, h->tail) == -1)
+		return set_err(h, CFFS_ERR_IO, "Cant write index %s: %s", h->index, strerror(errno));
+	h->dirty = 0;
+	return CFFS_OK;
+}
+
+
+off_t cffs_size(cffs_t *h)
+{
+	return h->dev.size;
+}
+
+
+uint32_t cffs_erasesize(cffs_t *h)
+{
+	return h->dev.erasesize;
+}
+
+
+int cffs_scan(cffs_t *h)
+{
+	int ret;
+
+	if(h->scanned)
+		return CFFS_OK;
+	h->count = 0;
+	h->tail = 0;
+	if(h->index && index_load(h->index, &h->dev, &h->hdrs, &h->count, &h->tail) == 0) {
+		h->scanned = 1;
+		return CFFS_OK;
+	}
+
+	ret = scan_chain(&h->dev, &h->hdrs, &h->count, &h->tail);
+	if(ret)
+		return set_err(h, ret, "Out of memory");
+	h->scanned = 1;
+	h->dirty = 1;
+	return CFFS_OK;
+}
+
+
+struct cffs_hdr *cffs_entries(cffs_t *h, int *count)
+{
+	*count = h->scanned ? h->count : 0;
+	return h->hdrs;
+}
+
+
+off_t cffs_free_space(cffs_t *h)
+{
+	if(cffs_scan(h))
+		return -1;
+	return h->dev.size - h->tail;
+}
+
+
+int cffs_pread(cffs_t *h, off_t pos, void *buf, size_t len)
+{
+	if(pos < 0 || pos + (off_t)len > h->dev.size)
+		return set_err(h, CFFS_ERR_RANGE, "Read past end of flash");
+	if(dev_read(&h->dev, pos, buf, len) == -1)
+		return set_err(h, CFFS_ERR_IO, "Cant read at 0x%8.8lX: %s", (unsigned long)pos,
+			       strerror(errno));
+	return CFFS_OK;
+}
+
+
+int cffs_sum(cffs_t *h, struct cffs_hdr *header, uint32_t *sum)
+{
+	int ret;
+
+	ret = stream_file(&h->dev, header, -1, sum);
+	return ret ? file_err(h, ret, header) : CFFS_OK;
+}
+
+
+ssize_t cffs_read(cffs_t *h, struct cffs_hdr *header, off_t off, void *buf, size_t len)
+{
+	off_t pos, end;
+	int ret;
+
+	ret = file_extent(&h->dev, header, &pos, &end);
+	if(ret)
+		return file_err(h, ret, header);
+	if(off < 0)
+		return set_err(h, CFFS_ERR_INVAL, "Negative offset");
+	if(off >= end - pos)
+		return 0;
+	if((off_t)len > end - pos - off)
+		len = end - pos - off;
+	if(dev_read(&h->dev, pos + off, buf, len) == -1)
+		return file_err(h, CFFS_ERR_IO, header);
+	return len;
+}
+
+
+int cffs_copy(cffs_t *h, struct cffs_hdr *header, int fd, int check)
+{
+	uint32_t sum;
+	int ret;
+
+	if(!check) {
+		ret = copy_file(&h->dev, header, fd);
+		return ret ? file_err(h, ret, header) : CFFS_OK;
+	}
+	ret = stream_file(&h->dev, header, fd, &sum);
+	if(ret)
+		return file_err(h, ret, header);
+	if(sum != header_sum(header))
+		return set_err(h, CFFS_ERR_CHKSUM, "Bad checksum on %s", header_name(header));
+	return CFFS_OK;
+}
+
+
+int cffs_put(cffs_t *h, char **files, int filecnt, uint32_t magic)
+{
+	off_t pos, tail;
+	int ret, scan;
+
+	if(!h->rdwr)
+		return set_err(h, CFFS_ERR_INVAL, "Device is not open for writing");
+	ret = cffs_scan(h);
+	if(ret)
+		return ret;
+	if(!magic)
+		magic = h->count ? h->hdrs[0].magic : CISCO_CLASSB;
+	if(magic == CISCO_CLASSA && !h->class_a)
+		return set_err(h, CFFS_ERR_UNSUPP, "Cant put Class A files, their CRC is unverified");
+
+	pos = tail = h->tail;
+	ret = put_files(h, &pos, files, filecnt, magic);
+
+	/* Pick up the new headers, including any written before a failure */
+	scan = scan_chain(&h->dev, &h->hdrs, &h->count, &tail);
+	h->tail = tail;
+	h->dirty = 1;
+	if(!ret && scan)
+		ret = set_err(h, scan, "Out of memory");
+	return ret;
+}
+
+
+int cffs_delete(cffs_t *h, struct cffs_hdr *header)
+{
+	int ret;
+
+	if(!h->rdwr)
+		return set_err(h, CFFS_ERR_INVAL, "Device is not open for writing");
+	ret = delete_file(h, header);
+	h->dirty = 1;
+	return ret;
+}
+
+
+int cffs_erase(cffs_t *h, int quick, struct cffs_erase_stats *stats)
+{
+	struct cffs_erase_stats tmp;
+	int ret;
+
+	if(!stats)
+		stats = &tmp;
+	memset(stats, 0, sizeof(struct cffs_erase_stats));
+	if(!h->rdwr)
+		return set_err(h, CFFS_ERR_INVAL, "Device is not open for writing");
+
+	ret = erase_device(h, quick, stats);
+
+	/* The old chain is gone, even if only part of it was erased */
+	free(h->hdrs);
+	h->hdrs = NULL;
+	h->count = 0;
+	h->tail = 0;
+	h->scanned = !ret;
+	h->dirty = !ret;
+	return ret;
+}
+
+
+int cffs_fsck(cffs_t *h, int jobs, cffs_fsck_fn fn, void *arg, struct cffs_fsck_result *res)
+{
+	struct cffs_fsck_result tmp;
+	off_t curpos = 0;
+	int ret;
+
+	if(!res)
+		res = &tmp;
+	memset(res, 0, sizeof(struct cffs_fsck_result));
+	res->nonblank = h->dev.size;
+
+	if(jobs > 1)
+		ret = fsck_files_parallel(h, jobs, fn, arg, &curpos, res);
+	else
+		ret = fsck_files(h, fn, arg, &curpos, res);
+	if(ret)
+		return ret;
+
+	/* Now check the rest of the flash is blank */
+	res->free = h->dev.size - curpos;
+	progress(h, CFFS_PROG_BLANK, 0, res->free);
+	res->nonblank = blank_check(h, curpos, jobs);
+	if(res->nonblank == -1)
+		return set_err(h, CFFS_ERR_IO, "Cant read free space");
+	if(res->nonblank < h->dev.size)
+		return set_err(h, CFFS_ERR_NOTBLANK, "Flash is not blank at offset 0x%8.8lX",
+			       (unsigned long)res->nonblank);
+	if(res->bad)
+		return set_err(h, CFFS_ERR_CHKSUM, "%d file(s) with bad checksums", res->bad);
+	return CFFS_OK;
+}
@@ -0,0 +1,142 @@
+/*
+ * $Id$
+ *
+ * libcffs - access to Cisco flash file systems on MTD devices and images
+ *
+ * A handle keeps the device open and the header chain scanned between
+ * calls, so a program can run many operations on a card without
+ * rescanning it. A handle must only be used by one thread at a time.
+ *
+ * Functions returning int give CFFS_OK or one of the negative CFFS_ERR_
+ * codes, cffs_errmsg() has the details of the last error.
+ *
+ */
+
+#ifndef LIBCFFS_H
+#define LIBCFFS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fileheader.h"
+#include "backend.h"
+#include "header.h"
+
+#define CFFS_OK			0
+#define CFFS_ERR_IO		-1	/* device read, write or erase failed */
+#define CFFS_ERR_NOMEM		-2
+#define CFFS_ERR_OPEN		-3	/* cant open the device */
+#define CFFS_ERR_MAGIC		-4	/* bad header magic */
+#define CFFS_ERR_RANGE		-5	/* file extends past end of flash */
+#define CFFS_ERR_NOSPC		-6	/* not enough free space */
+#define CFFS_ERR_CHKSUM		-7	/* file has a bad checksum */
+#define CFFS_ERR_NOTBLANK	-8	/* free space is not blank */
+#define CFFS_ERR_INVAL		-9
+#define CFFS_ERR_UNSUPP		-10	/* not supported for this file system */
+#define CFFS_ERR_SOURCE		-11	/* cant read a file being put */
+#define CFFS_ERR_OUTPUT		-12	/* cant write to the output file */
+
+/* Messages about work in progress, INFO goes with normal output */
+#define CFFS_LOG_INFO		0
+#define CFFS_LOG_WARN		1
+
+typedef void (*cffs_log_fn)(void *arg, int level, const char *msg);
+
+/* Progress of long operations, done out of total */
+enum cffs_progress {
+	CFFS_PROG_ERASE,	/* erasing block done */
+	CFFS_PROG_ERASE_CHECK,	/* checking block done is blank */
+	CFFS_PROG_BLANK		/* bytes of free space checked, 0 at the start */
+};
+
+typedef void (*cffs_progress_fn)(void *arg, enum cffs_progress what, long long done,
+				 long long total);
+
+/* Called for each file checked by cffs_fsck(), in on-flash order */
+typedef void (*cffs_fsck_fn)(void *arg, struct cffs_hdr *header, uint32_t sum);
+
+struct cffs_fsck_result {
+	int		files;
+	int		bad;		/* files with bad checksums */
+	off_t		free;		/* bytes of free space */
+	off_t		nonblank;	/* first non blank offset, or the device size */
+};
+
+struct cffs_erase_stats {
+	int		blocks;
+	int		erased;
+	int		ranges;		/* erase requests, for a quick erase */
+};
+
+typedef struct cffs cffs_t;
+
+/* Open a device or image, read-write if rdwr is set. emul may be NULL.
+ * On failure *h is still set if it could be allocated, so the error can
+ * be read with cffs_errmsg() before it is closed.
+ */
+int cffs_open(cffs_t **h, const char *device, int rdwr, struct nor_emul *emul);
+
+/* Writes the index if it has changed, then closes the handle */
+int cffs_close(cffs_t *h);
+
+const char *cffs_strerror(int err);
+const char *cffs_errmsg(cffs_t *h);
+
+void cffs_set_callbacks(cffs_t *h, cffs_log_fn log, cffs_progress_fn progress, void *arg);
+
+/* Keep a sidecar index of the headers in path, set before cffs_scan() */
+void cffs_set_index(cffs_t *h, const char *path);
+int cffs_sync(cffs_t *h);
+
+/* Allow cffs_put() to write Class A files. Their crc is taken to be the
+ * standard CRC-32, which has not been checked against a real card.
+ */
+void cffs_set_class_a(cffs_t *h, int allow);
+
+off_t cffs_size(cffs_t *h);
+uint32_t cffs_erasesize(cffs_t *h);
+
+/* Read the header chain, from the index if it is up to date. Only the
+ * first call does any work.
+ */
+int cffs_scan(cffs_t *h);
+
+/* The scanned headers. They stay valid until the next put or erase */
+struct cffs_hdr *cffs_entries(cffs_t *h, int *count);
+off_t cffs_free_space(cffs_t *h);
+
+/* Read len bytes of the device at pos, for callers that cache it */
+int cffs_pread(cffs_t *h, off_t pos, void *buf, size_t len);
+
+/* Checksum a file */
+int cffs_sum(cffs_t *h, struct cffs_hdr *header, uint32_t *sum);
+
+/* Read up to len bytes from offset off in a file. Returns the number of
+ * bytes read or an error code.
+ */
+ssize_t cffs_read(cffs_t *h, struct cffs_hdr *header, off_t off, void *buf, size_t len);
+
+/* Copy a file to fd. With check the checksum is verified on the way,
+ * otherwise the copy is done in the kernel where possible.
+ */
+int cffs_copy(cffs_t *h, struct cffs_hdr *header, int fd, int check);
+
+/* Put files on the end of the flash. Nothing is written unless they all
+ * fit and are regular files that can be opened, otherwise CFFS_ERR_NOSPC
+ * or CFFS_ERR_SOURCE. A magic of 0 uses the class of the files already
+ * there.
+ */
+int cffs_put(cffs_t *h, char **files, int filecnt, uint32_t magic);
+
+/* header must be one of the cffs_entries(), it is updated */
+int cffs_delete(cffs_t *h, struct cffs_hdr *header);
+
+/* Erase the whole device, with quick set only the blocks that need it */
+int cffs_erase(cffs_t *h, int quick, struct cffs_erase_stats *stats);
+
+/* Check every file and that the free space is blank, on jobs threads.
+ * Returns CFFS_ERR_NOTBLANK or CFFS_ERR_CHKSUM if the checks fail.
+ */
+int cffs_fsck(cffs_t *h, int jobs, cffs_fsck_fn fn, void *arg, struct cffs_fsck_result *res);
+
+#endif
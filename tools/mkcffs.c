@@ -0,0 +1,388 @@
+/*
+ * $Id$
+ *
+ * mkcffs - build a cisco flash filesystem image
+ *
+ * Copyright (C) 2002 Simon Evans (spse@secret.org.uk)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * Please see the file COPYING for more details
+ *
+ */
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "fileheader.h"
+#include "header.h"
+#include "accel.h"
+
+
+#define COPY_BUF_SZ	(1<<20)
+
+
+struct image {
+	int		fd;
+	char		*name;
+	off_t		size;
+	off_t		pos;		/* where the next header goes */
+	uint32_t	magic;
+	time_t		date;		/* 0 for the current time */
+	uint8_t		*buf;
+	int		files;
+};
+
+
+int pwrite_all(int fd, const void *buf, size_t len, off_t pos)
+{
+	ssize_t wrote;
+
+	while(len) {
+		wrote = pwrite(fd, buf, len, pos);
+		if(wrote == -1 && errno == EINTR)
+			continue;
+		if(wrote <= 0)
+			return -1;
+		buf = (const char *)buf + wrote;
+		pos += wrote;
+		len -= wrote;
+	}
+	return 0;
+}
+
+
+/* Copy fname into the image after its header, then write the header with
+ * the checksum of what was copied.
+ */
+int add_file(struct image *img, char *fname)
+{
+	struct cffs_hdr header;
+	struct stat sinfo;
+	uint8_t hbuf[sizeof(struct ca_hdr)];
+	uint32_t sum = 0;
+	off_t pos, end, next;
+	ssize_t red;
+	int fd, hlen;
+
+	fd = open(fname, O_RDONLY);
+	if(fd == -1) {
+		fprintf(stderr, "Cant open %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	if(fstat(fd, &sinfo) == -1) {
+		fprintf(stderr, "Cant stat %s: %s\n", fname, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if(!S_ISREG(sinfo.st_mode)) {
+		fprintf(stderr, "Skipping %s, not a file\n", fname);
+		close(fd);
+		return 0;
+	}
+
+	make_header(&header, img->magic, img->pos, fname, sinfo.st_size);
+	if(img->date) {
+		if(img->magic == CISCO_CLASSB)
+			header.hdr.cbfh.date = img->date;
+		else
+			header.hdr.cafh.date = img->date;
+	}
+	next = next_header_pos(&header);
+	if(next > img->size) {
+		fprintf(stderr, "%s does not fit, %ld bytes free\n", fname,
+			(long)(img->size - img->pos));
+		close(fd);
+		return -1;
+	}
+
+	file_bounds(&header, &pos, &end);
+	while(pos < end) {
+		red = read(fd, img->buf, (end - pos > COPY_BUF_SZ) ? COPY_BUF_SZ : end - pos);
+		if(red == -1 && errno == EINTR)
+			continue;
+		if(red <= 0) {
+			fprintf(stderr, "Cant read in all of file %s\n", fname);
+			close(fd);
+			return -1;
+		}
+		sum = file_sum(img->magic, sum, img->buf, red);
+		if(pwrite_all(img->fd, img->buf, red, pos) == -1)
+			goto write_err;
+		pos += red;
+	}
+	close(fd);
+
+	if(img->magic == CISCO_CLASSB)
+		header.hdr.cbfh.chksum = sum;
+	else
+		header.hdr.cafh.crc = sum;
+	hlen = encode_header(&header, hbuf);
+	if(pwrite_all(img->fd, hbuf, hlen, header.pos) == -1)
+		goto write_err;
+
+	/* Padding up to the next header is blank */
+	memset(img->buf, 0xff, next - end);
+	if(pwrite_all(img->fd, img->buf, next - end, end) == -1)
+		goto write_err;
+
+	printf("Adding file: %s\n", fname);
+	img->pos = next;
+	img->files++;
+	return 0;
+
+ write_err:
+	fprintf(stderr, "Error writing %s: %s\n", img->name, strerror(errno));
+	return -1;
+}
+
+
+/*
+ * Fill the image from img->pos to the end with 0xFF. A hole would read
+ * back as zeros, not as erased flash, so the space is allocated and then
+ * filled by copying the blank bytes already written to double them each
+ * time. copy_file_range keeps the copies in the kernel, and on file
+ * systems that can share extents they take no extra space or time.
+ */
+int blank_tail(struct image *img)
+{
+	off_t done, len, from, to;
+	ssize_t copied;
+
+	if(img->pos >= img->size)
+		return 0;
+
+	if(posix_fallocate(img->fd, img->pos, img->size - img->pos)
+	   && ftruncate(img->fd, img->size) == -1)
+		return -1;
+
+	len = img->size - img->pos;
+	done = (len > COPY_BUF_SZ) ? COPY_BUF_SZ : len;
+	memset(img->buf, 0xff, done);
+	if(pwrite_all(img->fd, img->buf, done, img->pos) == -1)
+		return -1;
+
+	while(done < len) {
+		from = img->pos;
+		to = img->pos + done;
+		copied = copy_file_range(img->fd, &from, img->fd, &to,
+					 (len - done > done) ? done : len - done, 0);
+		if(copied == -1 && errno == EINTR)
+			continue;
+		if(copied <= 0)
+			break;
+		done += copied;
+	}
+
+	/* copy_file_range not supported, write it out */
+	while(done < len) {
+		off_t part = (len - done > COPY_BUF_SZ) ? COPY_BUF_SZ : len - done;
+
+		if(pwrite_all(img->fd, img->buf, part, img->pos + done) == -1)
+			return -1;
+		done += part;
+	}
+	return 0;
+}
+
+
+int cmp_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+/* Add every regular file in dir, in name order so images are repeatable */
+int add_dir(struct image *img, char *dir)
+{
+	DIR *d;
+	struct dirent *de;
+	char **names = NULL, **grown, *path;
+	int count = 0, alloced = 0, cnt, ret = 0;
+
+	d = opendir(dir);
+	if(!d) {
+		fprintf(stderr, "Cant open %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+	while((de = readdir(d))) {
+		if(de->d_name[0] == '.')
+			continue;
+		if(count == alloced) {
+			alloced += 64;
+			grown = realloc(names, alloced * sizeof(char *));
+			if(!grown) {
+				perror("malloc: ");
+				ret = -1;
+				break;
+			}
+			names = grown;
+		}
+		if(asprintf(&path, "%s/%s", dir, de->d_name) == -1) {
+			perror("malloc: ");
+			ret = -1;
+			break;
+		}
+		names[count++] = path;
+	}
+	closedir(d);
+
+	if(!ret)
+		qsort(names, count, sizeof(char *), cmp_names);
+	for(cnt = 0; cnt < count; cnt++) {
+		if(!ret && add_file(img, names[cnt]) == -1)
+			ret = -1;
+		free(names[cnt]);
+	}
+	free(names);
+	return ret;
+}
+
+
+/* A manifest lists one file per line, blank lines and # comments are
+ * ignored. "-" reads the manifest from stdin.
+ */
+int add_manifest(struct image *img, char *manifest)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t alloced = 0;
+	ssize_t len;
+	int ret = 0;
+
+	fp = strcmp(manifest, "-") ? fopen(manifest, "r") : stdin;
+	if(!fp) {
+		fprintf(stderr, "Cant open %s: %s\n", manifest, strerror(errno));
+		return -1;
+	}
+	while(!ret && (len = getline(&line, &alloced, fp)) != -1) {
+		while(len && (line[len-1] == '\n' || line[len-1] == '\r'))
+			line[--len] = '\0';
+		if(!len || line[0] == '#')
+			continue;
+		ret = add_file(img, line);
+	}
+	free(line);
+	if(fp != stdin)
+		fclose(fp);
+	return ret;
+}
+
+
+off_t parse_size(char *arg)
+{
+	char *end;
+	off_t size = strtoull(arg, &end, 0);
+
+	switch(*end) {
+	case 'k': case 'K':
+		return size << 10;
+	case 'm': case 'M':
+		return size << 20;
+	case 'g': case 'G':
+		return size << 30;
+	case '\0':
+		return size;
+	}
+	return -1;
+}
+
+
+void usage(void)
+{
+	printf("Usage: mkcffs -s SIZE [-a] [-t DATE] [-m MANIFEST] IMAGE [DIR|FILES...]\n");
+	printf("\t-s SIZE\t\tSize of the image, may end in k, M or G\n");
+	printf("\t-a\t\tMake a Class A file system, the default is Class B\n");
+	printf("\t-t DATE\t\tDate to give the files, in seconds since 1970\n");
+	printf("\t-m MANIFEST\tAdd the files listed in MANIFEST, - for stdin\n");
+	printf("A single DIR adds all of the files in it\n");
+}
+
+
+int main(int argc, char **argv)
+{
+	struct image img;
+	struct stat sinfo;
+	char *manifest = NULL;
+	int a, ret = 0;
+
+	memset(&img, 0, sizeof(img));
+	img.magic = CISCO_CLASSB;
+	img.size = -1;
+
+	while((a = getopt(argc, argv, "s:at:m:h")) != -1) {
+		switch(a) {
+		case 's':
+			img.size = parse_size(optarg);
+			break;
+		case 'a':
+			img.magic = CISCO_CLASSA;
+			break;
+		case 't':
+			img.date = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			manifest = optarg;
+			break;
+		default:
+			usage();
+			exit(a == 'h' ? 0 : 1);
+		}
+	}
+	if(img.size <= 0 || optind >= argc) {
+		usage();
+		exit(1);
+	}
+
+	if(img.magic == CISCO_CLASSA)
+		fprintf(stderr, "Warning: the Class A CRC has not been checked against a real card\n");
+
+	img.name = argv[optind++];
+	img.buf = malloc(COPY_BUF_SZ);
+	if(!img.buf) {
+		perror("malloc: ");
+		exit(1);
+	}
+	img.fd = open(img.name, O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if(img.fd == -1) {
+		fprintf(stderr, "Cant create %s: %s\n", img.name, strerror(errno));
+		exit(1);
+	}
+
+	if(manifest)
+		ret = add_manifest(&img, manifest);
+	if(!ret && argc - optind == 1 && !stat(argv[optind], &sinfo) && S_ISDIR(sinfo.st_mode)) {
+		ret = add_dir(&img, argv[optind]);
+	} else {
+		while(!ret && optind < argc)
+			ret = add_file(&img, argv[optind++]);
+	}
+
+	if(!ret && blank_tail(&img) == -1) {
+		fprintf(stderr, "Error writing %s: %s\n", img.name, strerror(errno));
+		ret = -1;
+	}
+	if(close(img.fd) == -1)
+		ret = -1;
+	free(img.buf);
+
+	if(ret) {
+		unlink(img.name);
+		exit(1);
+	}
+	printf("%d file(s), %ld bytes free\n", img.files, (long)(img.size - img.pos));
+	return 0;
+}